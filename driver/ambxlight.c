@@ -19,9 +19,21 @@
 #include <linux/usb.h>
 #include <linux/mutex.h>
 #include <linux/proc_fs.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/sysfs.h>
+#include <linux/hrtimer.h>
 
 #include "ambxlight_params.h"
 #include "ambxlight_ioctl.h"
+#include "ambxlight_decode.h"
+
+#define CREATE_TRACE_POINTS
+#include "ambxlight_trace.h"
 
 /* Define these values to match your devices */
 #define CYBORG_AMBX_LIGHT_VENDOR_ID	0x06a3
@@ -34,6 +46,7 @@
 #define PROC_HEIGHT_ENTRY	"height"
 #define PROC_INTENSITY_ENTRY	"intensity"
 #define PROC_ENABLED_ENTRY	"enabled"
+#define PROC_ALLOCATIONS_ENTRY	"allocations"
 
 /* table of devices that work with this driver */
 static const struct usb_device_id ambx_light_table[] = {
@@ -47,52 +60,423 @@ MODULE_DEVICE_TABLE(usb, ambx_light_table);
 #define CYBORG_AMBX_LIGHT_MINOR_BASE	192
 
 /* our private defines. if this grows any larger, use your own .h file */
-#define MAX_TRANSFER		(PAGE_SIZE - 512)
-/* MAX_TRANSFER is chosen so that the VM is not stressed by
-   allocations > PAGE_SIZE and the number of packets in a page
-   is an integer 512 is the largest possible packet on EHCI */
+#define MAX_TRANSFER		64
+/* MAX_TRANSFER is the size of each pooled transfer buffer. it holds the
+   longest report (0xa2, 9 bytes) and the 11 byte parameter read with room
+   to spare for the unknown 0xa3 report */
 #define WRITES_IN_FLIGHT	8
 /* arbitrarily chosen */
+#define BATCH_TRANSFER		(WRITES_IN_FLIGHT * 16)
+/* BATCH_TRANSFER bounds a single RAW write, which may carry up to
+   WRITES_IN_FLIGHT framed reports */
+#define REFRESH_DELAY		20
+/* msec to wait after a state change before reading the parameters back,
+   so that a burst of changes is followed by a single refresh */
+#define SCHEDULE_TOLERANCE	2000
+/* default usec a scheduled color may be late before it is dropped */
+#define STREAM_URBS		2
+/* interrupt urbs in the AMBXLIGHT_MODE_STREAM ring, one on the wire while
+   the next one waits for its interval */
+#define LATENCY_BUCKETS		16
+/* submit to completion latency histogram, bucket n counts latencies below
+   2^n usec, the last one everything slower */
+
+struct usb_ambx_light;
+
+/* counters exported through sysfs */
+struct ambx_light_stats {
+	atomic_long_t		submitted;		/* urbs handed to the usb core */
+	atomic_long_t		completed;		/* urbs completed without error */
+	atomic_long_t		failed;			/* urbs failed on submit or completion */
+	atomic_long_t		eagain;			/* writes rejected with -EAGAIN */
+	atomic_long_t		dropped;		/* colors dropped in atomic context */
+	atomic_long_t		bytes_sent;		/* payload bytes sent to the device */
+	atomic_t		in_flight;		/* urbs submitted and not completed */
+	atomic_long_t		latency[LATENCY_BUCKETS];	/* submit to completion latency */
+	atomic_long_t		group_frames;		/* group frames sent from this node */
+	atomic_long_t		group_skew;		/* nsec between first and last submit of the last one */
+	atomic_long_t		group_skew_max;		/* worst of those */
+	atomic_long_t		group_frame_spans;	/* group frames that spanned usb frames */
+	atomic_long_t		streamed;		/* colors sent over the interrupt endpoint */
+	atomic_long_t		stream_fallbacks;	/* times streaming fell back to control */
+};
+
+/* a preallocated urb with its pinned transfer buffer and setup packet */
+struct ambx_light_slot {
+	struct usb_ambx_light	*dev;			/* the device owning this slot */
+	struct urb		*urb;			/* the urb, recycled on completion */
+	unsigned char		*buf;			/* coherent transfer buffer */
+	struct usb_ctrlrequest	*dr;			/* setup packet information */
+	struct list_head	list;			/* entry in the free list */
+	bool			internal;		/* sent by the refresh itself */
+	ktime_t			submit_time;		/* when the urb was submitted */
+};
 
 /* Structure to hold all of our device specific stuff */
 struct usb_ambx_light {
 	struct usb_device	*udev;			/* the usb device for this device */
 	struct usb_interface	*interface;		/* the interface for this device */
+	int			minor;			/* our minor, kept past disconnect */
 	struct semaphore	limit_sem;		/* limiting the number of writes in progress */
 	struct usb_anchor	submitted;		/* in case we need to retract our submissions */
-	unsigned char			*ctrl_buffer;	/* the buffer to send/receive data */
-	struct urb		*ctrl_urb;			/* the urb to write/read data with */
-	struct usb_ctrlrequest	*ctrl_dr;	/* setup packet information */
-	size_t			ctrl_size;		/* the size of the send/receive buffer */
-	__u8			ctrl_endpointAddr;	/* the address of the ctrl endpoint */
+	struct ambx_light_slot	slots[WRITES_IN_FLIGHT];	/* urb pool, one per write in flight */
+	struct list_head	free_slots;		/* slots not currently submitted */
+	spinlock_t		slot_lock;		/* lock for free_slots and the pending color */
+	unsigned char		pending_color[9];	/* newest color waiting for a free slot */
+	bool			color_pending;		/* pending_color holds an unsent color */
+	struct mutex		batch_mutex;		/* serializes writers reserving several slots */
+	atomic_t		allocations;		/* urbs and buffers allocated so far */
+	struct ambx_light_stats	stats;			/* performance counters */
+	struct ambx_light_slot	stream[STREAM_URBS];	/* interrupt urb ring for AMBXLIGHT_MODE_STREAM */
+	unsigned long		stream_idle;		/* ring urbs not submitted, one bit each */
+	unsigned char		stream_color[9];	/* newest color waiting for a ring urb */
+	bool			stream_pending;		/* stream_color holds an unsent color */
+	bool			stream_broken;		/* the endpoint failed, colors go over control */
+	spinlock_t		stream_lock;		/* lock for the ring */
+	__u8			stream_endpointAddr;	/* the interrupt out endpoint, 0 if none */
+	int			stream_interval;	/* its polling interval */
 	int			errors;			/* the last request tanked */
-	bool			ongoing_read;		/* a read is going on */
+	bool			ongoing_read;		/* a parameter refresh is going on */
+	unsigned int		params_generation;	/* bumped for each completed read, under err_lock */
+	unsigned int		params_failures;	/* bumped for each failed refresh, under err_lock */
+	int			params_error;		/* error of the last failed refresh */
+	struct delayed_work	params_work;		/* deferred, coalesced parameter refresh */
+	wait_queue_head_t	wait;			/* woken when a slot or params come back */
 	spinlock_t		err_lock;		/* lock for errors */
 	struct kref		kref;
 	struct mutex		io_mutex;		/* synchronize I/O with disconnect */
 	union ambxlight_params params;		/* ambx device parameters */
+	unsigned char		color[9];		/* last color report sent, under err_lock */
+	bool			color_known;		/* color matches the device */
+	struct mutex		state_mutex;		/* serializes AMBXLIGHT_IOCTL_STATE */
+	int			group_minors[AMBXLIGHT_GROUP_MAX];	/* sync group led by this node */
+	unsigned int		group_count;		/* pods in the sync group */
+	struct mutex		group_mutex;		/* lock for the sync group */
 	unsigned char	transfer_mode;		/* transfer mode configured by ioctl */
+	unsigned char	coalesce;		/* coalesce colors when the pool is exhausted */
+	struct ambxlight_shared	*shared;	/* color register page mapped by userspace */
+	__u32			shared_generation;	/* generation of the last color sent */
+	struct mutex		shared_mutex;		/* serializes pickups of the register */
+	unsigned int		shared_period;		/* msec between pickups, 0 to disable */
+	struct delayed_work	shared_work;		/* periodic pickup */
+	struct ambxlight_effect	effect;			/* effect program being played */
+	unsigned int		effect_index;		/* next keyframe to send */
+	spinlock_t		effect_lock;		/* lock for effect and effect_index */
+	struct hrtimer		effect_timer;		/* plays the effect program */
+	struct ambxlight_scheduled	schedule[AMBXLIGHT_SCHEDULE_DEPTH];	/* colors ordered by deadline */
+	unsigned int		schedule_count;		/* entries in schedule */
+	struct ambxlight_lateness	lateness[AMBXLIGHT_SCHEDULE_DEPTH];	/* ring of outcomes */
+	unsigned int		lateness_head;		/* oldest outcome in the ring */
+	unsigned int		lateness_count;		/* outcomes in the ring */
+	unsigned int		schedule_tolerance;	/* usec a color may be late */
+	spinlock_t		schedule_lock;		/* lock for the schedule and the ring */
+	struct hrtimer		schedule_timer;		/* fires at the earliest deadline */
+	unsigned int		hex_rate;		/* HEXSTREAM colors per second, 0 for newest wins */
 	struct proc_dir_entry* proc_dir;	/* linked proc directory entry */
 };
 #define to_ambx_light_dev(d) container_of(d, struct usb_ambx_light, kref)
 
+/* per open file state */
+struct ambx_light_file {
+	struct usb_ambx_light	*dev;			/* the device this file was opened on */
+	struct mutex		read_mutex;		/* serializes readers sharing the file */
+	union ambxlight_params	params;			/* snapshot being read out */
+	unsigned int		params_generation;	/* generation of that snapshot */
+	unsigned int		params_failures;	/* failed refreshes seen by this file */
+	unsigned int		outbyte;		/* bytes of the snapshot left to read */
+	bool			eof;			/* snapshot read out, report end of file once */
+	struct mutex		write_mutex;		/* serializes writers sharing the file */
+	struct ambxlight_hex_parser	hex;		/* HEXSTREAM line being parsed */
+	s64			pace_next;		/* nsec deadline of the next paced color */
+};
+#define file_to_ambx_light_dev(f) (((struct ambx_light_file *)(f)->private_data)->dev)
+
 static struct usb_driver ambx_light_driver;
+/* held while a group frame locks several devices */
+static DEFINE_MUTEX(ambx_light_group_lock);
 static void ambx_light_draw_down(struct usb_ambx_light *dev);
+static int ambx_light_submit_pending_color(struct ambx_light_slot *slot);
+static ssize_t ambx_light_pre_get_params(struct usb_ambx_light *dev);
+static ssize_t ambx_light_get_params(struct usb_ambx_light *dev);
+
+static void ambx_light_free_slot(struct usb_ambx_light *dev,
+				 struct ambx_light_slot *slot)
+{
+	if (slot->buf)
+		usb_free_coherent(dev->udev, MAX_TRANSFER, slot->buf,
+				  slot->urb->transfer_dma);
+	usb_free_urb(slot->urb);
+	kfree(slot->dr);
+}
+
+static void ambx_light_free_slots(struct usb_ambx_light *dev)
+{
+	int i;
+
+	for (i = 0; i < WRITES_IN_FLIGHT; i++)
+		ambx_light_free_slot(dev, &dev->slots[i]);
+	for (i = 0; i < STREAM_URBS; i++)
+		ambx_light_free_slot(dev, &dev->stream[i]);
+}
+
+static int ambx_light_alloc_slot(struct usb_ambx_light *dev,
+				 struct ambx_light_slot *slot)
+{
+	slot->dev = dev;
+	slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!slot->urb)
+		return -ENOMEM;
+	atomic_inc(&dev->allocations);
+
+	slot->buf = usb_alloc_coherent(dev->udev, MAX_TRANSFER,
+				GFP_KERNEL, &slot->urb->transfer_dma);
+	if (!slot->buf)
+		return -ENOMEM;
+	atomic_inc(&dev->allocations);
+	slot->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	slot->dr = kmalloc(sizeof(struct usb_ctrlrequest), GFP_KERNEL);
+	if (!slot->dr)
+		return -ENOMEM;
+	atomic_inc(&dev->allocations);
+
+	return 0;
+}
+
+static int ambx_light_alloc_slots(struct usb_ambx_light *dev)
+{
+	int retval;
+	int i;
+
+	INIT_LIST_HEAD(&dev->free_slots);
+	for (i = 0; i < WRITES_IN_FLIGHT; i++) {
+		retval = ambx_light_alloc_slot(dev, &dev->slots[i]);
+		if (retval)
+			return retval;
+		list_add_tail(&dev->slots[i].list, &dev->free_slots);
+	}
+
+	return 0;
+}
+
+/*
+ * take a slot out of the pool. the caller must hold one count of limit_sem,
+ * which guarantees that a free slot is available.
+ */
+static struct ambx_light_slot *ambx_light_get_slot(struct usb_ambx_light *dev)
+{
+	struct ambx_light_slot *slot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->slot_lock, flags);
+	slot = list_first_entry(&dev->free_slots, struct ambx_light_slot, list);
+	list_del(&slot->list);
+	spin_unlock_irqrestore(&dev->slot_lock, flags);
+	slot->internal = false;
+
+	return slot;
+}
+
+/*
+ * give a slot back to the pool and release its count of limit_sem. if a
+ * coalesced color is waiting, the slot goes straight to it instead.
+ */
+static void ambx_light_put_slot(struct ambx_light_slot *slot)
+{
+	struct usb_ambx_light *dev = slot->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->slot_lock, flags);
+	if (dev->color_pending) {
+		memcpy(slot->buf, dev->pending_color, sizeof(dev->pending_color));
+		dev->color_pending = false;
+		spin_unlock_irqrestore(&dev->slot_lock, flags);
+
+		if (!ambx_light_submit_pending_color(slot))
+			return;
+
+		spin_lock_irqsave(&dev->slot_lock, flags);
+	}
+	list_add(&slot->list, &dev->free_slots);
+	spin_unlock_irqrestore(&dev->slot_lock, flags);
+	up(&dev->limit_sem);
+
+	/* let pollers know they can write again */
+	wake_up_interruptible(&dev->wait);
+}
+
+/*
+ * park a color until a slot comes back. returns false if a slot was freed
+ * in the meantime, in which case the caller should try to reserve it.
+ */
+static bool ambx_light_coalesce_color(struct usb_ambx_light *dev,
+				      const unsigned char *buf)
+{
+	unsigned long flags;
+	bool parked = false;
+
+	spin_lock_irqsave(&dev->slot_lock, flags);
+	if (list_empty(&dev->free_slots)) {
+		/* latest wins, an older unsent color is simply replaced */
+		memcpy(dev->pending_color, buf, sizeof(dev->pending_color));
+		dev->color_pending = true;
+		parked = true;
+	}
+	spin_unlock_irqrestore(&dev->slot_lock, flags);
+
+	return parked;
+}
+
+static int ambx_light_down(struct usb_ambx_light *dev, bool nonblock)
+{
+	if (!nonblock)
+		return down_interruptible(&dev->limit_sem) ? -ERESTARTSYS : 0;
+	return down_trylock(&dev->limit_sem) ? -EAGAIN : 0;
+}
+
+/*
+ * reserve count slots of the pool. writers reserving more than one slot are
+ * serialized, so that two of them can't each hold part of the pool while
+ * waiting for the rest.
+ */
+static int ambx_light_reserve_slots(struct usb_ambx_light *dev, int count,
+				     bool nonblock)
+{
+	int retval = 0;
+	int i;
+
+	if (count > 1) {
+		if (nonblock) {
+			if (!mutex_trylock(&dev->batch_mutex))
+				return -EAGAIN;
+		} else if (mutex_lock_interruptible(&dev->batch_mutex)) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		retval = ambx_light_down(dev, nonblock);
+		if (retval)
+			break;
+	}
+
+	if (count > 1)
+		mutex_unlock(&dev->batch_mutex);
+
+	/* all or nothing */
+	if (retval)
+		while (i--)
+			up(&dev->limit_sem);
+
+	return retval;
+}
+
+/*
+ * keep the cached state in step with the reports sent, so that
+ * AMBXLIGHT_IOCTL_STATE can leave out what the device already has. the
+ * next parameter refresh replaces the guess with what the device says.
+ */
+static void ambx_light_track_report(struct usb_ambx_light *dev,
+				    const unsigned char *buf)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	switch (buf[0]) {
+		case 0xa1: /* set device state */
+			dev->params.param.enabled = buf[2];
+			break;
+		case 0xa2: /* set color */
+			memcpy(dev->color, buf, sizeof(dev->color));
+			dev->color_known = true;
+			break;
+		case 0xa4: /* set location */
+			dev->params.param.location = buf[2];
+			dev->params.param.center = buf[3];
+			break;
+		case 0xa5: /* set height */
+			dev->params.param.height = buf[2];
+			break;
+		case 0xa6: /* set intensity */
+			dev->params.param.intensity = buf[2];
+			break;
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+}
+
+/* anchor and submit a filled slot, the slot stays ours if this fails */
+static int ambx_light_submit_slot(struct ambx_light_slot *slot,
+				  gfp_t mem_flags)
+{
+	struct usb_ambx_light *dev = slot->dev;
+	int retval;
+
+	usb_anchor_urb(slot->urb, &dev->submitted);
+	slot->submit_time = ktime_get();
+	atomic_inc(&dev->stats.in_flight);
+
+	retval = usb_submit_urb(slot->urb, mem_flags);
+	trace_ambxlight_urb_submit(dev->minor, le16_to_cpu(slot->dr->wValue),
+				   slot->urb->transfer_buffer_length, retval);
+	if (retval) {
+		atomic_dec(&dev->stats.in_flight);
+		atomic_long_inc(&dev->stats.failed);
+		usb_unanchor_urb(slot->urb);
+		return retval;
+	}
+
+	atomic_long_inc(&dev->stats.submitted);
+	if (!slot->internal)
+		ambx_light_track_report(dev, slot->buf);
+	return 0;
+}
+
+/* account a completed slot, called from its completion handler */
+static void ambx_light_complete_slot(struct ambx_light_slot *slot,
+				     struct urb *urb, bool out)
+{
+	struct ambx_light_stats *stats = &slot->dev->stats;
+	s64 latency;
+	int bucket;
+
+	latency = ktime_us_delta(ktime_get(), slot->submit_time);
+	trace_ambxlight_urb_complete(slot->dev->minor,
+				     le16_to_cpu(slot->dr->wValue),
+				     urb->status, urb->actual_length, latency);
+
+	atomic_dec(&stats->in_flight);
+	if (urb->status) {
+		atomic_long_inc(&stats->failed);
+		return;
+	}
+	atomic_long_inc(&stats->completed);
+	if (out)
+		atomic_long_add(urb->actual_length, &stats->bytes_sent);
+
+	bucket = latency > 0 ? fls64(latency) : 0;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+	atomic_long_inc(&stats->latency[bucket]);
+}
 
 static void ambx_light_delete(struct kref *kref)
 {
 	struct usb_ambx_light *dev = to_ambx_light_dev(kref);
 
-	usb_free_urb(dev->ctrl_urb);
+	/* the works use dev, make sure none is left pending */
+	cancel_delayed_work_sync(&dev->params_work);
+	cancel_delayed_work_sync(&dev->shared_work);
+
+	ambx_light_free_slots(dev);
+	free_page((unsigned long)dev->shared);
 	usb_put_dev(dev->udev);
-	kfree(dev->ctrl_buffer);
-	kfree(dev->ctrl_dr);
 	kfree(dev);
 }
 
 static int ambx_light_open(struct inode *inode, struct file *file)
 {
 	struct usb_ambx_light *dev;
+	struct ambx_light_file *priv;
 	struct usb_interface *interface;
 	int subminor;
 	int retval = 0;
@@ -113,15 +497,27 @@ static int ambx_light_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+	mutex_init(&priv->read_mutex);
+	mutex_init(&priv->write_mutex);
+	priv->dev = dev;
+	priv->params_failures = READ_ONCE(dev->params_failures);
+
 	retval = usb_autopm_get_interface(interface);
-	if (retval)
+	if (retval) {
+		kfree(priv);
 		goto exit;
+	}
 
 	/* increment our usage count for the device */
 	kref_get(&dev->kref);
 
 	/* save our object in the file's private structure */
-	file->private_data = dev;
+	file->private_data = priv;
 
 exit:
 	return retval;
@@ -129,11 +525,14 @@ exit:
 
 static int ambx_light_release(struct inode *inode, struct file *file)
 {
+	struct ambx_light_file *priv;
 	struct usb_ambx_light *dev;
 
-	dev = file->private_data;
-	if (dev == NULL)
+	priv = file->private_data;
+	if (priv == NULL)
 		return -ENODEV;
+	dev = priv->dev;
+	kfree(priv);
 
 	/* allow the device to be autosuspended */
 	mutex_lock(&dev->io_mutex);
@@ -151,9 +550,7 @@ static int ambx_light_flush(struct file *file, fl_owner_t id)
 	struct usb_ambx_light *dev;
 	int res;
 
-	dev = file->private_data;
-	if (dev == NULL)
-		return -ENODEV;
+	dev = file_to_ambx_light_dev(file);
 
 	/* wait for io to stop */
 	mutex_lock(&dev->io_mutex);
@@ -170,30 +567,43 @@ static int ambx_light_flush(struct file *file, fl_owner_t id)
 	return res;
 }
 
+/*
+ * a refresh didn't bring new parameters. readers waiting for them get the
+ * error instead, dev->errors is left for flush() to report.
+ */
+static void ambx_light_refresh_failed(struct usb_ambx_light *dev, int error)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->params_error = (error == -EPIPE) ? error : -EIO;
+	dev->params_failures++;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	dev->ongoing_read = false;
+
+	wake_up_interruptible(&dev->wait);
+}
+
 static void ambx_light_read_ctrl_callback(struct urb *urb)
 {
+	struct ambx_light_slot *slot;
 	struct usb_ambx_light *dev;
 
-	dev = urb->context;
+	slot = urb->context;
+	dev = slot->dev;
 
-	if (urb->actual_length == 9) {
+	if (urb->status == 0 && urb->actual_length == 9) {
 		unsigned char i;
-		dev_info(&dev->interface->dev,
-		"load parameters: %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-			 ((char *)urb->transfer_buffer)[0] & 0xff, /* 0xb0 */
-			 ((char *)urb->transfer_buffer)[1] & 0xff,
-			 ((char *)urb->transfer_buffer)[2] & 0xff,
-			 ((char *)urb->transfer_buffer)[3] & 0xff,
-			 ((char *)urb->transfer_buffer)[4] & 0xff,
-			 ((char *)urb->transfer_buffer)[5] & 0xff,
-			 ((char *)urb->transfer_buffer)[6] & 0xff,
-			 ((char *)urb->transfer_buffer)[7] & 0xff,
-			 ((char *)urb->transfer_buffer)[8] & 0xff
-			 );
+		spin_lock(&dev->err_lock);
 		for (i = 0; i < urb->actual_length; i++) {
 			dev->params.raw[i] = ((char *)urb->transfer_buffer)[i] & 0xff;
 		}
+		dev->params_generation++;
+		spin_unlock(&dev->err_lock);
+		trace_ambxlight_params(dev->minor, slot->buf,
+				       dev->params_generation);
 	}
+	dev->ongoing_read = false;
 
 	/* sync/async unlink faults aren't errors */
 	if (urb->status) {
@@ -208,40 +618,144 @@ static void ambx_light_read_ctrl_callback(struct urb *urb)
 		dev->errors = urb->status;
 		spin_unlock(&dev->err_lock);
 	}
+	if (urb->status || urb->actual_length != 9)
+		ambx_light_refresh_failed(dev, urb->status);
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&dev->limit_sem);
+	/* give the urb back to the pool */
+	ambx_light_complete_slot(slot, urb, false);
+	ambx_light_put_slot(slot);
+}
+
+/*
+ * schedule a parameter refresh. requests made while one is pending are
+ * merged into it. safe to call from completion context.
+ */
+static void ambx_light_request_refresh(struct usb_ambx_light *dev,
+				       unsigned int delay)
+{
+	dev->ongoing_read = true;
+	schedule_delayed_work(&dev->params_work, msecs_to_jiffies(delay));
+}
+
+static void ambx_light_params_work(struct work_struct *work)
+{
+	struct usb_ambx_light *dev;
+	ssize_t retval;
+
+	dev = container_of(to_delayed_work(work), struct usb_ambx_light,
+			   params_work);
+
+	/*
+	 * the control pipe keeps our requests in order, so the read can be
+	 * queued right behind the prepare read report
+	 */
+	retval = ambx_light_pre_get_params(dev);
+	if (retval >= 0)
+		retval = ambx_light_get_params(dev);
+	if (retval < 0)
+		ambx_light_refresh_failed(dev, retval);
+}
+
+static bool ambx_light_params_failed(struct usb_ambx_light *dev,
+				     unsigned int failures)
+{
+	return READ_ONCE(dev->params_failures) != failures;
+}
+
+static bool ambx_light_params_newer(struct usb_ambx_light *dev,
+				    unsigned int generation)
+{
+	return READ_ONCE(dev->params_generation) != generation;
 }
 
+/*
+ * every open file reads its own snapshot of the parameters. once a snapshot
+ * has been read out (and end of file reported), the next read waits for a
+ * newer one instead of returning the same bytes again.
+ */
 static ssize_t ambx_light_read(struct file *file, char *user_buffer,
 			  size_t count, loff_t *ppos)
 {
+	struct ambx_light_file *priv;
 	struct usb_ambx_light *dev;
-	static unsigned outbyte = 9;
-	unsigned char *str;
+	int retval = 0;
+
+	priv = file->private_data;
+	dev = priv->dev;
+
+	if (mutex_lock_interruptible(&priv->read_mutex))
+		return -ERESTARTSYS;
+
+	if (priv->outbyte == 0) {
+		if (priv->eof) {
+			priv->eof = false;
+			goto exit;
+		}
 
-	dev = file->private_data;
-	str = dev->params.raw;
+		if (!ambx_light_params_newer(dev, priv->params_generation) &&
+		    !ambx_light_params_failed(dev, priv->params_failures)) {
+			/* don't queue a refresh for a gone device */
+			mutex_lock(&dev->io_mutex);
+			if (!dev->interface) {
+				mutex_unlock(&dev->io_mutex);
+				retval = -ENODEV;
+				goto exit;
+			}
+			if (!READ_ONCE(dev->ongoing_read))
+				ambx_light_request_refresh(dev, 0);
+			mutex_unlock(&dev->io_mutex);
+			if (file->f_flags & O_NONBLOCK) {
+				retval = -EAGAIN;
+				goto exit;
+			}
+			retval = wait_event_interruptible(dev->wait,
+				ambx_light_params_newer(dev, priv->params_generation) ||
+				ambx_light_params_failed(dev, priv->params_failures) ||
+				!dev->interface);
+			if (retval)
+				goto exit;
+		}
+		if (!dev->interface) {
+			retval = -ENODEV;
+			goto exit;
+		}
 
-	if( count > outbyte ) {
-		count = outbyte;
+		spin_lock_irq(&dev->err_lock);
+		priv->params_failures = dev->params_failures;
+		if (dev->params_generation == priv->params_generation) {
+			/* the refresh failed, each file reports it once */
+			retval = dev->params_error;
+			spin_unlock_irq(&dev->err_lock);
+			goto exit;
+		}
+		priv->params = dev->params;
+		priv->params_generation = dev->params_generation;
+		spin_unlock_irq(&dev->err_lock);
+		priv->outbyte = sizeof(priv->params.raw);
 	}
-	outbyte = outbyte - count;
-	if (copy_to_user(user_buffer, str, count)) return -EFAULT;
-	if (count == 0) {
-		outbyte = 9;
+
+	if (count > priv->outbyte)
+		count = priv->outbyte;
+	if (copy_to_user(user_buffer,
+			 &priv->params.raw[sizeof(priv->params.raw) - priv->outbyte],
+			 count)) {
+		retval = -EFAULT;
+		goto exit;
 	}
-	return count;
+	priv->outbyte -= count;
+	if (priv->outbyte == 0)
+		priv->eof = true;
+	retval = count;
 
+exit:
+	mutex_unlock(&priv->read_mutex);
+	return retval;
 }
 
 static ssize_t ambx_light_get_params(struct usb_ambx_light *dev)
 {
 	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
+	struct ambx_light_slot *slot;
 
 	/*
 	 * limit the number of URBs in flight to stop a user from using up all
@@ -252,89 +766,51 @@ static ssize_t ambx_light_get_params(struct usb_ambx_light *dev)
 		goto exit;
 	}
 
-	spin_lock_irq(&dev->err_lock);
-	retval = dev->errors;
-	if (retval < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		retval = (retval == -EPIPE) ? retval : -EIO;
-	}
-	spin_unlock_irq(&dev->err_lock);
-	if (retval < 0)
-		goto error;
-
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
-
-	buf = usb_alloc_coherent(dev->udev, 11, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
-	}
+	/* take a preallocated urb and buffer from the pool */
+	slot = ambx_light_get_slot(dev);
 
 	/* this lock makes sure we don't submit URBs to gone devices */
 	mutex_lock(&dev->io_mutex);
 	if (!dev->interface) {		/* disconnect() was called */
 		mutex_unlock(&dev->io_mutex);
 		retval = -ENODEV;
-		goto error;
+		goto error_put;
 	}
 
 	/* initialize the urb properly */
-	dev->ctrl_dr = kmalloc(sizeof(struct usb_ctrlrequest), GFP_KERNEL);
-	if (!dev->ctrl_dr) {
-		retval = -ENOMEM;
-		goto error;
-	}
-	dev->ctrl_dr->bRequestType = 0xa1;
-	dev->ctrl_dr->bRequest = 0x01;
-	dev->ctrl_dr->wValue = 0x0b;
-	dev->ctrl_dr->wIndex = 0x03;
-	dev->ctrl_dr->wLength = 0x0b;
+	slot->dr->bRequestType = 0xa1;
+	slot->dr->bRequest = 0x01;
+	slot->dr->wValue = cpu_to_le16(0x0b);
+	slot->dr->wIndex = cpu_to_le16(0x03);
+	slot->dr->wLength = cpu_to_le16(0x0b);
 
-	usb_fill_control_urb(urb, dev->udev,
+	usb_fill_control_urb(slot->urb, dev->udev,
 			  usb_rcvctrlpipe(dev->udev, 0),
-			  (unsigned char*)dev->ctrl_dr,
-			  buf,
+			  (unsigned char*)slot->dr,
+			  slot->buf,
 			  11,
 			  ambx_light_read_ctrl_callback,
-			  dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+			  slot);
 
 	/* send the data out the ctrl port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
+	dev->ongoing_read = true;
+	retval = ambx_light_submit_slot(slot, GFP_KERNEL);
 	mutex_unlock(&dev->io_mutex);
 	if (retval) {
 		dev_err(&dev->interface->dev,
 			"%s - failed submitting write urb, error %d\n",
 			__func__, retval);
-		goto error_unanchor;
+		goto error_put;
 	}
 
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
-
 	return 0;
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-		usb_free_coherent(dev->udev, 11, buf, urb->transfer_dma);
-		usb_free_urb(urb);
-	}
-	up(&dev->limit_sem);
+error_put:
+	ambx_light_put_slot(slot);
 
 exit:
+	/* the refresh chain ends here */
+	dev->ongoing_read = false;
 	return retval;
 }
 
@@ -343,9 +819,9 @@ struct proc_dir_entry* root_dir;
 static ssize_t proc_entry_read(struct file *filp, char *buf, size_t len, loff_t *data)
 {
 	struct usb_ambx_light *dev;
-	static unsigned long outbyte = 5;
+	static unsigned long outbyte = 12;
 	static unsigned long buflen;
-	char outdata[5];
+	char outdata[12];
 
 	dev = PDE_DATA(file_inode(filp));
 
@@ -362,6 +838,9 @@ static ssize_t proc_entry_read(struct file *filp, char *buf, size_t len, loff_t
 		case 'e': /* enabled */
 			buflen = sprintf(outdata, "%x\n", dev->params.param.enabled);
 			break;
+		case 'a': /* allocations */
+			buflen = sprintf(outdata, "%d\n", atomic_read(&dev->allocations));
+			break;
 		default:
 			return -EFAULT;
 	}
@@ -374,78 +853,173 @@ static ssize_t proc_entry_read(struct file *filp, char *buf, size_t len, loff_t
 	outbyte = outbyte - len;
 	if (copy_to_user(buf, outdata, len)) return -EFAULT;
 	if (len == 0) {
-		outbyte = 5;
+		outbyte = sizeof(outdata);
 	}
 	return len;
 }
 
-static ssize_t ambx_light_pre_get_params(struct usb_ambx_light *dev);
-
 static void ambx_light_write_ctrl_callback(struct urb *urb)
 {
+	struct ambx_light_slot *slot;
 	struct usb_ambx_light *dev;
+	unsigned char opcode;
+	bool internal;
+	int status;
 
-	dev = urb->context;
+	slot = urb->context;
+	dev = slot->dev;
+	opcode = slot->buf[0];
+	internal = slot->internal;
+	status = urb->status;
 
 	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
+	if (status) {
+		if (!(status == -ENOENT ||
+		    status == -ECONNRESET ||
+		    status == -ESHUTDOWN))
 			dev_err(&dev->interface->dev,
 				"%s - nonzero write ctrl status received: %d\n",
-				__func__, urb->status);
+				__func__, status);
 
 		spin_lock(&dev->err_lock);
-		dev->errors = urb->status;
+		dev->errors = status;
 		spin_unlock(&dev->err_lock);
 	}
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&dev->limit_sem);
+	/* give the urb back to the pool, it may be reused right away */
+	ambx_light_complete_slot(slot, urb, true);
+	ambx_light_put_slot(slot);
+
+	if (internal)
+		return;
 
-	if (urb->actual_length == 2) {
-		ambx_light_get_params(dev);
-	} else if (urb->actual_length > 2 && urb->actual_length < 5) {
-		ambx_light_pre_get_params(dev);
+	/* a failed color leaves the cached one wrong, parameters get read back */
+	if (status && opcode == 0xa2) {
+		spin_lock(&dev->err_lock);
+		dev->color_known = false;
+		spin_unlock(&dev->err_lock);
+		return;
 	}
 
+	/* read the parameters back once a burst of changes has settled */
+	switch (opcode) {
+		case 0xa1: /* set device state */
+		case 0xa4: /* set location */
+		case 0xa5: /* set height */
+		case 0xa6: /* set intensity */
+		case 0xa7: /* prepare read parameters */
+			ambx_light_request_refresh(dev, REFRESH_DELAY);
+			break;
+	}
 }
 
-static ssize_t ambx_light_write(struct file *file, const char *user_buffer,
-			  size_t count, loff_t *ppos)
+/* set up a slot as a SET_REPORT carrying the report in its buffer */
+static void ambx_light_fill_write_urb(struct usb_ambx_light *dev,
+				      struct ambx_light_slot *slot, size_t size)
 {
-	struct usb_ambx_light *dev;
-	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	char *userdata = NULL;
-	size_t writesize = min(count, (size_t)MAX_TRANSFER);
-	int retlen = writesize;
+	slot->dr->bRequestType = 0x21;
+	slot->dr->bRequest = 0x09;
+	slot->dr->wValue = cpu_to_le16(slot->buf[0]);
+	slot->dr->wIndex = cpu_to_le16(0x03);
+	slot->dr->wLength = cpu_to_le16(size);
+
+	usb_fill_control_urb(slot->urb, dev->udev,
+			  usb_sndctrlpipe(dev->udev, 0),
+			  (unsigned char*)slot->dr,
+			  slot->buf,
+			  size,
+			  ambx_light_write_ctrl_callback,
+			  slot);
+}
 
-	dev = file->private_data;
+/* called from completion context when a slot is handed to a parked color */
+static int ambx_light_submit_pending_color(struct ambx_light_slot *slot)
+{
+	struct usb_ambx_light *dev = slot->dev;
+	unsigned long flags;
+	int retval;
 
-	/* verify that we actually have some data to write */
-	if (count == 0)
-		goto exit;
+	/* the slot may have carried a refresh, the color must be tracked */
+	slot->internal = false;
+	ambx_light_fill_write_urb(dev, slot, sizeof(dev->pending_color));
+
+	/* disconnect() poisons the pool, so this can't reach a gone device */
+	retval = ambx_light_submit_slot(slot, GFP_ATOMIC);
+	if (retval) {
+		/* the coalesced color is lost, the cached one can't be trusted */
+		spin_lock_irqsave(&dev->err_lock, flags);
+		dev->color_known = false;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+	}
+
+	return retval;
+}
+
+/*
+ * send a color from atomic context. this never waits for a slot, a color
+ * finding the pool exhausted is parked as the coalesced color instead. a
+ * slot caught on its way in or out of the pool can't take the color, and
+ * retrying here could spin forever, so the color is dropped then.
+ */
+static int ambx_light_send_color_atomic(struct usb_ambx_light *dev,
+					const unsigned char *buf)
+{
+	struct ambx_light_slot *slot;
+	int retval;
+
+	if (down_trylock(&dev->limit_sem)) {
+		if (ambx_light_coalesce_color(dev, buf))
+			return 0;
+		atomic_long_inc(&dev->stats.dropped);
+		return -EAGAIN;
+	}
+
+	slot = ambx_light_get_slot(dev);
+	memcpy(slot->buf, buf, sizeof(dev->pending_color));
+	ambx_light_fill_write_urb(dev, slot, sizeof(dev->pending_color));
+
+	/* disconnect() poisons the pool, so this can't reach a gone device */
+	retval = ambx_light_submit_slot(slot, GFP_ATOMIC);
+	if (retval)
+		ambx_light_put_slot(slot);
+
+	return retval;
+}
+
+/*
+ * submit npackets reports laid out back to back in buf as one anchored
+ * chain. a lone color may be coalesced instead of waiting for a slot.
+ * returns the number of reports accepted or a negative error.
+ */
+static int ambx_light_submit_reports(struct usb_ambx_light *dev,
+				     const unsigned char *buf,
+				     const size_t *sizes, int npackets,
+				     bool nonblock, bool coalesce)
+{
+	struct ambx_light_slot *slots[WRITES_IN_FLIGHT];
+	int retval;
+	size_t offset;
+	int nsubmitted;
+	int i;
+
+	coalesce = coalesce && npackets == 1 && buf[0] == 0xa2;
 
 	/*
 	 * limit the number of URBs in flight to stop a user from using up all
 	 * RAM
 	 */
-	if (!(file->f_flags & O_NONBLOCK)) {
-		if (down_interruptible(&dev->limit_sem)) {
-			retval = -ERESTARTSYS;
-			goto exit;
-		}
-	} else {
-		if (down_trylock(&dev->limit_sem)) {
-			retval = -EAGAIN;
-			goto exit;
-		}
+	retval = ambx_light_reserve_slots(dev, npackets, nonblock || coalesce);
+	if (retval == -EAGAIN && coalesce) {
+		if (ambx_light_coalesce_color(dev, buf))
+			return npackets;
+		/* a slot is on its way back to the pool, wait for it */
+		if (!nonblock)
+			retval = ambx_light_reserve_slots(dev, npackets, false);
 	}
+	if (retval == -EAGAIN)
+		atomic_long_inc(&dev->stats.eagain);
+	if (retval)
+		goto exit;
 
 	spin_lock_irq(&dev->err_lock);
 	retval = dev->errors;
@@ -459,301 +1033,1098 @@ static ssize_t ambx_light_write(struct file *file, const char *user_buffer,
 	if (retval < 0)
 		goto error;
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
+	/* take preallocated urbs and buffers from the pool */
+	for (i = 0, offset = 0; i < npackets; offset += sizes[i++]) {
+		slots[i] = ambx_light_get_slot(dev);
+		memcpy(slots[i]->buf, &buf[offset], sizes[i]);
 	}
 
-	userdata = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!userdata) {
-		retval = -ENOMEM;
-		goto error;
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error_put;
 	}
 
-	if (copy_from_user(userdata, user_buffer, writesize)) {
+	/* send the chain out the ctrl port, the device sees it in order */
+	for (nsubmitted = 0; nsubmitted < npackets; nsubmitted++) {
+		ambx_light_fill_write_urb(dev, slots[nsubmitted],
+					  sizes[nsubmitted]);
+		retval = ambx_light_submit_slot(slots[nsubmitted], GFP_KERNEL);
+		if (retval) {
+			dev_err(&dev->interface->dev,
+				"%s - failed submitting write urb, error %d\n",
+				__func__, retval);
+			break;
+		}
+	}
+	mutex_unlock(&dev->io_mutex);
+
+	/* give back what didn't make it */
+	for (i = nsubmitted; i < npackets; i++)
+		ambx_light_put_slot(slots[i]);
+
+	return nsubmitted ? nsubmitted : retval;
+
+error_put:
+	for (i = 0; i < npackets; i++)
+		ambx_light_put_slot(slots[i]);
+	goto exit;
+error:
+	for (i = 0; i < npackets; i++)
+		up(&dev->limit_sem);
+
+exit:
+	return retval;
+}
+
+/*
+ * AMBXLIGHT_MODE_STREAM sends colors over the interrupt out endpoint. the
+ * ring urbs go out once per endpoint interval, a completing urb is
+ * resubmitted right away with the newest color if there is one and goes
+ * idle otherwise. should the endpoint fail, the colors fall back to
+ * control transfers until the mode is set again.
+ */
+static void ambx_light_stream_callback(struct urb *urb);
+
+/* submit a ring urb with the color in buf, stream_lock held */
+static int ambx_light_submit_stream(struct usb_ambx_light *dev,
+				    struct ambx_light_slot *slot,
+				    const unsigned char *buf)
+{
+	memcpy(slot->buf, buf, AMBXLIGHT_COLOR_REPORT);
+	/* only read by the tracepoints, the urb has no setup stage */
+	slot->dr->wValue = cpu_to_le16(buf[0]);
+
+	usb_fill_int_urb(slot->urb, dev->udev,
+			 usb_sndintpipe(dev->udev, dev->stream_endpointAddr),
+			 slot->buf, AMBXLIGHT_COLOR_REPORT,
+			 ambx_light_stream_callback, slot,
+			 dev->stream_interval);
+	slot->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	return ambx_light_submit_slot(slot, GFP_ATOMIC);
+}
+
+/* give up on the interrupt endpoint, stream_lock held */
+static void ambx_light_stream_fail(struct usb_ambx_light *dev, int status)
+{
+	if (dev->stream_broken)
+		return;
+	dev->stream_broken = true;
+	atomic_long_inc(&dev->stats.stream_fallbacks);
+	/* may run after disconnect() cleared interface */
+	dev_warn(&dev->udev->dev,
+		 "%s - interrupt endpoint failed (%d), streaming over control\n",
+		 __func__, status);
+}
+
+/*
+ * hand a color to the ring. returns 0 if it was sent or parked for the
+ * next free urb, 1 if it has to go over control instead.
+ */
+static int ambx_light_stream_color(struct usb_ambx_light *dev,
+				   const unsigned char *buf)
+{
+	struct ambx_light_slot *slot;
+	unsigned long flags;
+	int retval = 0;
+	int i;
+
+	spin_lock_irqsave(&dev->stream_lock, flags);
+	if (!dev->stream_endpointAddr || dev->stream_broken) {
+		retval = 1;
+		goto unlock;
+	}
+
+	if (!dev->stream_idle) {
+		/* latest wins, the next completion picks it up */
+		memcpy(dev->stream_color, buf, sizeof(dev->stream_color));
+		dev->stream_pending = true;
+		goto unlock;
+	}
+
+	i = __ffs(dev->stream_idle);
+	slot = &dev->stream[i];
+	retval = ambx_light_submit_stream(dev, slot, buf);
+	if (retval) {
+		ambx_light_stream_fail(dev, retval);
+		retval = 1;
+		goto unlock;
+	}
+	dev->stream_idle &= ~BIT(i);
+	atomic_long_inc(&dev->stats.streamed);
+
+unlock:
+	spin_unlock_irqrestore(&dev->stream_lock, flags);
+	return retval;
+}
+
+static void ambx_light_stream_callback(struct urb *urb)
+{
+	struct ambx_light_slot *slot = urb->context;
+	struct usb_ambx_light *dev = slot->dev;
+	unsigned char color[AMBXLIGHT_COLOR_REPORT];
+	bool fallback = false;
+	int retval;
+
+	ambx_light_complete_slot(slot, urb, true);
+
+	spin_lock(&dev->stream_lock);
+	/* unlinked by disconnect or suspend, not the endpoint's fault */
+	if (urb->status && !(urb->status == -ENOENT ||
+			     urb->status == -ECONNRESET ||
+			     urb->status == -ESHUTDOWN))
+		ambx_light_stream_fail(dev, urb->status);
+
+	if (dev->stream_pending && !dev->stream_broken && !urb->status) {
+		dev->stream_pending = false;
+		retval = ambx_light_submit_stream(dev, slot, dev->stream_color);
+		if (!retval) {
+			atomic_long_inc(&dev->stats.streamed);
+			spin_unlock(&dev->stream_lock);
+			return;
+		}
+		dev->stream_pending = true;
+		ambx_light_stream_fail(dev, retval);
+	}
+
+	dev->stream_idle |= BIT(slot - dev->stream);
+	if (dev->stream_pending && dev->stream_broken) {
+		/* the parked color goes over control */
+		memcpy(color, dev->stream_color, sizeof(color));
+		dev->stream_pending = false;
+		fallback = true;
+	}
+	spin_unlock(&dev->stream_lock);
+
+	if (fallback)
+		ambx_light_send_color_atomic(dev, color);
+}
+
+/*
+ * AMBXLIGHT_MODE_STREAM writes are 3 byte RGB colors like
+ * AMBXLIGHT_MODE_COLOR, they never wait, a color finding the ring busy
+ * replaces the one waiting for it.
+ */
+static ssize_t ambx_light_write_stream(struct file *file,
+				       const char *user_buffer, size_t count)
+{
+	struct usb_ambx_light *dev;
+	unsigned char buf[AMBXLIGHT_COLOR_REPORT];
+	size_t size = sizeof(buf);
+	int retval;
+
+	dev = file_to_ambx_light_dev(file);
+
+	if (count != 3)
+		return -EFAULT;
+	if (copy_from_user(buf, user_buffer, count))
+		return -EFAULT;
+	ambxlight_pack_color(buf, buf[0], buf[1], buf[2], 0);
+	trace_ambxlight_decode(dev->minor, AMBXLIGHT_MODE_STREAM, 1);
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		return -ENODEV;
+	}
+	retval = ambx_light_stream_color(dev, buf);
+	mutex_unlock(&dev->io_mutex);
+
+	if (retval > 0)
+		retval = ambx_light_submit_reports(dev, buf, &size, 1,
+						   file->f_flags & O_NONBLOCK,
+						   true);
+	return retval < 0 ? retval : count;
+}
+
+/* record what became of a scheduled color, the oldest outcome is dropped */
+static void ambx_light_report_lateness(struct usb_ambx_light *dev,
+				       s64 timestamp, s64 lateness, int status)
+{
+	struct ambxlight_lateness *report;
+	unsigned int tail;
+
+	tail = (dev->lateness_head + dev->lateness_count) %
+		AMBXLIGHT_SCHEDULE_DEPTH;
+	if (dev->lateness_count == AMBXLIGHT_SCHEDULE_DEPTH)
+		dev->lateness_head = (dev->lateness_head + 1) %
+			AMBXLIGHT_SCHEDULE_DEPTH;
+	else
+		dev->lateness_count++;
+
+	report = &dev->lateness[tail];
+	report->timestamp = timestamp;
+	report->lateness = lateness;
+	report->status = status;
+	report->reserved = 0;
+}
+
+/*
+ * sends every color whose deadline has passed, dropping those later than
+ * the tolerance, then rearms itself for the next deadline. the timer is
+ * only ever started under schedule_lock, so it always matches the head of
+ * the queue.
+ */
+static enum hrtimer_restart ambx_light_schedule_timer(struct hrtimer *timer)
+{
+	struct usb_ambx_light *dev;
+	struct ambxlight_scheduled *entry;
+	unsigned long flags;
+	s64 now, lateness;
+	int status;
+
+	dev = container_of(timer, struct usb_ambx_light, schedule_timer);
+
+	spin_lock_irqsave(&dev->schedule_lock, flags);
+	now = ktime_to_ns(ktime_get());
+	while (dev->schedule_count && dev->schedule[0].timestamp <= now) {
+		entry = &dev->schedule[0];
+		lateness = now - entry->timestamp;
+		status = -ETIME;
+		if (lateness <= (s64)dev->schedule_tolerance * NSEC_PER_USEC)
+			status = ambx_light_send_color_atomic(dev, entry->report);
+		ambx_light_report_lateness(dev, entry->timestamp, lateness,
+					   status);
+
+		dev->schedule_count--;
+		memmove(&dev->schedule[0], &dev->schedule[1],
+			dev->schedule_count * sizeof(dev->schedule[0]));
+	}
+	if (dev->schedule_count)
+		hrtimer_start(timer, ns_to_ktime(dev->schedule[0].timestamp),
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&dev->schedule_lock, flags);
+
+	/* there is room in the queue again */
+	wake_up_interruptible(&dev->wait);
+
+	return HRTIMER_NORESTART;
+}
+
+static int ambx_light_schedule_color(struct usb_ambx_light *dev,
+				     const struct ambxlight_scheduled *entry)
+{
+	unsigned long flags;
+	unsigned int i;
+	int retval = 0;
+
+	/* don't arm the timer for a gone device */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	spin_lock_irqsave(&dev->schedule_lock, flags);
+	if (dev->schedule_count == AMBXLIGHT_SCHEDULE_DEPTH) {
+		retval = -EAGAIN;
+		goto unlock;
+	}
+
+	/* keep the queue ordered by deadline, new entries usually go last */
+	for (i = dev->schedule_count;
+	     i > 0 && dev->schedule[i - 1].timestamp > entry->timestamp; i--)
+		dev->schedule[i] = dev->schedule[i - 1];
+	dev->schedule[i] = *entry;
+	dev->schedule_count++;
+
+	if (i == 0)
+		hrtimer_start(&dev->schedule_timer,
+			      ns_to_ktime(entry->timestamp), HRTIMER_MODE_ABS);
+
+unlock:
+	spin_unlock_irqrestore(&dev->schedule_lock, flags);
+exit:
+	mutex_unlock(&dev->io_mutex);
+	return retval;
+}
+
+/* AMBXLIGHT_MODE_SCHEDULED writes are arrays of struct ambxlight_scheduled */
+static ssize_t ambx_light_write_scheduled(struct file *file,
+					  const char *user_buffer, size_t count)
+{
+	struct usb_ambx_light *dev;
+	struct ambxlight_scheduled entry;
+	size_t written = 0;
+	int retval = 0;
+
+	dev = file_to_ambx_light_dev(file);
+
+	if (count % sizeof(entry))
+		return -EFAULT;
+
+	while (written < count) {
+		if (copy_from_user(&entry, user_buffer + written, sizeof(entry))) {
+			retval = -EFAULT;
+			break;
+		}
+		if (entry.report[0] != 0xa2 || entry.report[1] != 0x00) {
+			retval = -EFAULT;
+			break;
+		}
+
+		retval = ambx_light_schedule_color(dev, &entry);
+		if (retval == -EAGAIN && !written &&
+		    !(file->f_flags & O_NONBLOCK)) {
+			/* queue full, wait for the timer to drain it */
+			retval = wait_event_interruptible(dev->wait,
+				READ_ONCE(dev->schedule_count) < AMBXLIGHT_SCHEDULE_DEPTH ||
+				!dev->interface);
+			if (!retval)
+				continue;
+		}
+		if (retval)
+			break;
+		written += sizeof(entry);
+	}
+
+	return written ? written : retval;
+}
+
+/* queue a HEXSTREAM color on the schedule, one period after the last one */
+static int ambx_light_pace_color(struct file *file, struct ambx_light_file *priv,
+				 unsigned int rate)
+{
+	struct usb_ambx_light *dev = priv->dev;
+	struct ambxlight_scheduled entry;
+	s64 now;
+	int retval;
+
+	now = ktime_to_ns(ktime_get());
+	if (priv->pace_next < now)
+		priv->pace_next = now;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.timestamp = priv->pace_next;
+	ambxlight_pack_color(entry.report, priv->hex.color[0],
+			     priv->hex.color[1], priv->hex.color[2], 0);
+
+	while ((retval = ambx_light_schedule_color(dev, &entry)) == -EAGAIN &&
+	       !(file->f_flags & O_NONBLOCK)) {
+		/* queue full, wait for the timer to drain it */
+		retval = wait_event_interruptible(dev->wait,
+			READ_ONCE(dev->schedule_count) < AMBXLIGHT_SCHEDULE_DEPTH ||
+			!dev->interface);
+		if (retval)
+			break;
+	}
+	if (retval)
+		return retval;
+
+	priv->pace_next += NSEC_PER_SEC / rate;
+	return 0;
+}
+
+/*
+ * AMBXLIGHT_MODE_HEXSTREAM writes carry any number of newline separated
+ * hex colors, a line may be split across writes. without a rate only the
+ * newest color of a write is sent, coalesced while the pool is busy.
+ * with a rate every color is paced out through the schedule.
+ */
+static ssize_t ambx_light_write_hexstream(struct file *file,
+					  const char *user_buffer, size_t count)
+{
+	struct ambx_light_file *priv = file->private_data;
+	struct usb_ambx_light *dev = priv->dev;
+	unsigned char chunk[BATCH_TRANSFER];
+	unsigned char color[AMBXLIGHT_COLOR_REPORT];
+	size_t size = sizeof(color);
+	size_t offset, len, i;
+	unsigned int rate;
+	int ncolors = 0;
+	ssize_t retval = 0;
+
+	if (mutex_lock_interruptible(&priv->write_mutex))
+		return -ERESTARTSYS;
+
+	rate = READ_ONCE(dev->hex_rate);
+
+	for (offset = 0; offset < count; offset += len) {
+		len = min(count - offset, sizeof(chunk));
+		if (copy_from_user(chunk, user_buffer + offset, len)) {
+			retval = -EFAULT;
+			goto exit;
+		}
+
+		for (i = 0; i < len; i++) {
+			if (!ambxlight_hex_feed(&priv->hex, chunk[i]))
+				continue;
+			ncolors++;
+
+			if (!rate) {
+				ambxlight_pack_color(color, priv->hex.color[0],
+						     priv->hex.color[1],
+						     priv->hex.color[2], 0);
+				continue;
+			}
+
+			retval = ambx_light_pace_color(file, priv, rate);
+			if (retval) {
+				/* leave the line complete for the retry */
+				priv->hex.digits = 6;
+				if (offset + i)
+					retval = offset + i;
+				goto exit;
+			}
+		}
+	}
+	trace_ambxlight_decode(dev->minor, AMBXLIGHT_MODE_HEXSTREAM, ncolors);
+
+	if (ncolors && !rate) {
+		retval = ambx_light_submit_reports(dev, color, &size, 1,
+						   file->f_flags & O_NONBLOCK,
+						   true);
+		if (retval < 0)
+			goto exit;
+	}
+	retval = count;
+
+exit:
+	mutex_unlock(&priv->write_mutex);
+	return retval;
+}
+
+static ssize_t ambx_light_write(struct file *file, const char *user_buffer,
+			  size_t count, loff_t *ppos)
+{
+	struct usb_ambx_light *dev;
+	int retval = 0;
+	size_t sizes[WRITES_IN_FLIGHT];
+	unsigned char buf[BATCH_TRANSFER];
+	size_t writesize = min(count, sizeof(buf));
+	int retlen = writesize;
+	int npackets = 0;
+	int i;
+
+	dev = file_to_ambx_light_dev(file);
+
+	trace_ambxlight_write(dev->minor, count);
+
+	/* verify that we actually have some data to write */
+	if (count == 0)
+		goto exit;
+
+	if (dev->transfer_mode == AMBXLIGHT_MODE_SCHEDULED)
+		return ambx_light_write_scheduled(file, user_buffer, count);
+	if (dev->transfer_mode == AMBXLIGHT_MODE_HEXSTREAM)
+		return ambx_light_write_hexstream(file, user_buffer, count);
+	if (dev->transfer_mode == AMBXLIGHT_MODE_STREAM)
+		return ambx_light_write_stream(file, user_buffer, count);
+
+	if (copy_from_user(buf, user_buffer, writesize)) {
 		retval = -EFAULT;
-		goto error;
+		goto exit;
 	}
 
+	/* decode and validate everything before touching the device */
 	switch (dev->transfer_mode) {
-		unsigned char i;
 		default:
 			dev->transfer_mode = AMBXLIGHT_MODE_HEXSTRING;
 		case AMBXLIGHT_MODE_HEXSTRING:
 			if (writesize != 6 && writesize != 7) { /* hex string + line break */
 				retval = -EFAULT;
-				goto error;
-			}
-			for (i = 0; i < 6; i++) {
-				if (userdata[i] >= '0' && userdata[i] <= '9') {
-					userdata[i] -= '0';
-				} else if (userdata[i] >= 'a' && userdata[i] <= 'f') {
-					userdata[i] -= 'a' - 10;
-				} else if (userdata[i] >= 'A' && userdata[i] <= 'F') {
-					userdata[i] -= 'A' - 10;
-				} else {
-					retval = -EFAULT;
-					goto error;
-				}
-				userdata[i/2] = i % 2 ? userdata[i/2] | userdata[i] : userdata[i] << 4;
+				goto exit;
 			}
+			retval = ambxlight_decode_hexstring(buf, buf);
+			if (retval)
+				goto exit;
 			writesize = 3;
 		case AMBXLIGHT_MODE_COLOR:
 			/* check data format */
 			if (writesize != 3) {
 				retval = -EFAULT;
-				goto error;
+				goto exit;
 			}
-			writesize = 9;
-			buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
-					&urb->transfer_dma);
-			if (!buf) {
-				retval = -ENOMEM;
-				goto error;
-			}
-			((char *)buf)[0] = 0xa2;
-			((char *)buf)[1] = 0x00;
-			((char *)buf)[2] = userdata[0] & 0xff;
-			((char *)buf)[3] = userdata[1] & 0xff;
-			((char *)buf)[4] = userdata[2] & 0xff;
-			((char *)buf)[5] = 0x00;
-			((char *)buf)[6] = 0x00;
-			((char *)buf)[7] = 0x00;
-			((char *)buf)[8] = 0x00;
-
+			ambxlight_pack_color(buf, buf[0], buf[1], buf[2], 0);
+			sizes[npackets++] = AMBXLIGHT_COLOR_REPORT;
 			break;
 		case AMBXLIGHT_MODE_RAW:
-			/*
-			 * urb data packet format
-			 *
-			 * |  00  |  01  |  02  | 03.. |
-			 * |OPCODE| 0x00 |  values...  |
-			 *
-			 */
-			buf = userdata;
+			/* a write may carry several framed reports back to back */
+			retval = ambxlight_decode_raw(buf, writesize, sizes,
+						      WRITES_IN_FLIGHT,
+						      MAX_TRANSFER);
+			if (retval < 0)
+				goto exit;
+			npackets = retval;
+			break;
+	}
+	trace_ambxlight_decode(dev->minor, dev->transfer_mode, npackets);
 
-			/* check data format */
-			if (writesize < 2 || (buf[1] && 0xff) != 0x00) {
-				retval = -EFAULT;
-				goto error;
-			}
+	retval = ambx_light_submit_reports(dev, buf, sizes, npackets,
+					   file->f_flags & O_NONBLOCK,
+					   dev->coalesce);
+	if (retval <= 0)
+		goto exit;
 
-			/* check data size */
-			switch (buf[0] & 0xff) {
-				case 0xa1: /* set device state */
-				case 0xa5: /* set height */
-				case 0xa6: /* set intensity */
-					if (writesize != 3) {
-						retval = -EFAULT;
-						goto error;
-					}
-					break;
-				case 0xa2: /* chenge light color */
-					if (writesize != 9) {
-						retval = -EFAULT;
-						goto error;
-					}
-					break;
-				case 0xa3:
-					/* unknown */
-					break;
-				case 0xa4: /* set location */
-					if (writesize != 4) {
-						retval = -EFAULT;
-						goto error;
-					}
-					break;
-				case 0xa7: /* prepare read parameters */
-					if (writesize != 2) {
-						retval = -EFAULT;
-						goto error;
-					}
-					break;
-				default:
-					retval = -EFAULT;
-					goto error;
-			}
-			break;
+	/* report only the reports that made it */
+	if (retval < npackets)
+		for (retlen = 0, i = 0; i < retval; i++)
+			retlen += sizes[i];
+	return retlen;
+
+exit:
+	return retval;
+}
+
+static ssize_t ambx_light_pre_get_params(struct usb_ambx_light *dev)
+{
+	int retval = 0;
+	struct ambx_light_slot *slot;
+	size_t writesize = 2;
+
+	/*
+	 * limit the number of URBs in flight to stop a user from using up all
+	 * RAM
+	 */
+	if (down_interruptible(&dev->limit_sem)) {
+		retval = -ERESTARTSYS;
+		goto exit;
 	}
 
+	/* take a preallocated urb and buffer from the pool */
+	slot = ambx_light_get_slot(dev);
+	slot->internal = true;
+	slot->buf[0] = 0xa7;
+	slot->buf[1] = 0x00;
+
 	/* this lock makes sure we don't submit URBs to gone devices */
 	mutex_lock(&dev->io_mutex);
 	if (!dev->interface) {		/* disconnect() was called */
 		mutex_unlock(&dev->io_mutex);
 		retval = -ENODEV;
-		goto error;
+		goto error_put;
 	}
 
 	/* initialize the urb properly */
-	dev->ctrl_dr = kmalloc(sizeof(struct usb_ctrlrequest), GFP_KERNEL);
-	if (!dev->ctrl_dr) {
-		retval = -ENOMEM;
-		goto error;
-	}
-	dev->ctrl_dr->bRequestType = 0x21;
-	dev->ctrl_dr->bRequest = 0x09;
-	dev->ctrl_dr->wValue = (buf[0] & 0xff);
-	dev->ctrl_dr->wIndex = 0x03;
-	dev->ctrl_dr->wLength = writesize;
-
-
-	usb_fill_control_urb(urb, dev->udev,
-			  usb_sndctrlpipe(dev->udev, 0),
-			  (unsigned char*)dev->ctrl_dr,
-			  buf,
-			  writesize,
-			  ambx_light_write_ctrl_callback,
-			  dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	ambx_light_fill_write_urb(dev, slot, writesize);
 
 	/* send the data out the ctrl port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
+	dev->ongoing_read = true;
+	retval = ambx_light_submit_slot(slot, GFP_KERNEL);
 	mutex_unlock(&dev->io_mutex);
 	if (retval) {
 		dev_err(&dev->interface->dev,
 			"%s - failed submitting write urb, error %d\n",
 			__func__, retval);
-		goto error_unanchor;
+		goto error_put;
 	}
 
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
+	return writesize;
 
+error_put:
+	ambx_light_put_slot(slot);
 
-	return retlen;
+exit:
+	/* the refresh chain ends here */
+	dev->ongoing_read = false;
+	return retval;
+}
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-		usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-		usb_free_urb(urb);
+/*
+ * send the color in the shared register if userspace published a new one.
+ * the register is read seqlock style, giving up if the producer keeps it
+ * busy, the next kick will pick it up.
+ */
+static int ambx_light_pick_shared(struct usb_ambx_light *dev)
+{
+	struct ambxlight_shared *shared = dev->shared;
+	unsigned char buf[AMBXLIGHT_COLOR_REPORT];
+	size_t size = sizeof(buf);
+	__u32 sequence, generation;
+	int tries = 16;
+	int retval = 0;
+
+	mutex_lock(&dev->shared_mutex);
+	do {
+		if (!tries--)
+			goto exit;
+		sequence = READ_ONCE(shared->sequence);
+		smp_rmb();
+		generation = READ_ONCE(shared->generation);
+		ambxlight_pack_color(buf, READ_ONCE(shared->red),
+				     READ_ONCE(shared->green),
+				     READ_ONCE(shared->blue),
+				     READ_ONCE(shared->fade));
+		smp_rmb();
+	} while ((sequence & 1) || sequence != READ_ONCE(shared->sequence));
+
+	if (generation == dev->shared_generation)
+		goto exit;
+
+	/* never wait for a slot here, a newer color wins over a queued one */
+	retval = ambx_light_submit_reports(dev, buf, &size, 1, true, true);
+	if (retval > 0) {
+		dev->shared_generation = generation;
+		retval = 0;
 	}
-	up(&dev->limit_sem);
 
 exit:
+	mutex_unlock(&dev->shared_mutex);
 	return retval;
 }
 
-static ssize_t ambx_light_pre_get_params(struct usb_ambx_light *dev)
+static void ambx_light_shared_work(struct work_struct *work)
+{
+	struct usb_ambx_light *dev;
+
+	dev = container_of(to_delayed_work(work), struct usb_ambx_light,
+			   shared_work);
+
+	ambx_light_pick_shared(dev);
+	if (dev->shared_period)
+		schedule_delayed_work(&dev->shared_work,
+				      msecs_to_jiffies(dev->shared_period));
+}
+
+static ktime_t ambx_light_ms_to_ktime(unsigned int msec)
+{
+	return ktime_set(msec / MSEC_PER_SEC, (msec % MSEC_PER_SEC) * NSEC_PER_MSEC);
+}
+
+/* sends the next keyframe and sleeps through its fade and hold time */
+static enum hrtimer_restart ambx_light_effect_timer(struct hrtimer *timer)
+{
+	struct usb_ambx_light *dev;
+	struct ambxlight_keyframe *frame;
+	unsigned char buf[AMBXLIGHT_COLOR_REPORT];
+	unsigned int period;
+	unsigned long flags;
+
+	dev = container_of(timer, struct usb_ambx_light, effect_timer);
+
+	spin_lock_irqsave(&dev->effect_lock, flags);
+	if (dev->effect_index >= dev->effect.count) {
+		if (!(dev->effect.flags & AMBXLIGHT_EFFECT_LOOP) ||
+		    dev->effect.count == 0) {
+			spin_unlock_irqrestore(&dev->effect_lock, flags);
+			return HRTIMER_NORESTART;
+		}
+		dev->effect_index = 0;
+	}
+	frame = &dev->effect.frames[dev->effect_index++];
+	ambxlight_pack_color(buf, frame->red, frame->green, frame->blue,
+			     frame->fade);
+	period = frame->fade + frame->hold;
+	spin_unlock_irqrestore(&dev->effect_lock, flags);
+
+	ambx_light_send_color_atomic(dev, buf);
+
+	hrtimer_forward_now(timer, ambx_light_ms_to_ktime(max(period, 1U)));
+	return HRTIMER_RESTART;
+}
+
+/* replace the running effect program, a program without frames stops it */
+static int ambx_light_set_effect(struct usb_ambx_light *dev,
+				 const struct ambxlight_effect __user *arg)
 {
+	struct ambxlight_effect *effect;
+	unsigned long flags;
 	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	size_t writesize = 2;
 
-	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
-	 */
-	if (down_interruptible(&dev->limit_sem)) {
-		retval = -ERESTARTSYS;
+	effect = kmalloc(sizeof(*effect), GFP_KERNEL);
+	if (!effect)
+		return -ENOMEM;
+	if (copy_from_user(effect, arg, sizeof(*effect))) {
+		retval = -EFAULT;
+		goto exit;
+	}
+	if (effect->count > AMBXLIGHT_EFFECT_MAX_FRAMES) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	/* don't arm the timer for a gone device */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
 		goto exit;
 	}
 
+	hrtimer_cancel(&dev->effect_timer);
+	spin_lock_irqsave(&dev->effect_lock, flags);
+	dev->effect = *effect;
+	dev->effect_index = 0;
+	spin_unlock_irqrestore(&dev->effect_lock, flags);
+	if (effect->count)
+		hrtimer_start(&dev->effect_timer, ktime_set(0, 0),
+			      HRTIMER_MODE_REL);
+	mutex_unlock(&dev->io_mutex);
+
+exit:
+	kfree(effect);
+	return retval;
+}
+
+/*
+ * apply the fields of a struct ambxlight_state in one chain of reports,
+ * leaving out those the device already has
+ */
+static int ambx_light_set_state(struct usb_ambx_light *dev,
+				const struct ambxlight_state __user *arg,
+				bool nonblock)
+{
+	struct ambxlight_state state;
+	unsigned char buf[AMBXLIGHT_COLOR_REPORT + 3 + 4 + 3 + 3];
+	size_t sizes[5];
+	unsigned char *p = buf;
+	int npackets = 0;
+	int retval;
+
+	if (copy_from_user(&state, arg, sizeof(state)))
+		return -EFAULT;
+	if (state.mask & ~AMBXLIGHT_STATE_ALL)
+		return -EINVAL;
+
+	/* compare and send as one, against other state changes */
+	if (mutex_lock_interruptible(&dev->state_mutex))
+		return -ERESTARTSYS;
+
 	spin_lock_irq(&dev->err_lock);
-	retval = dev->errors;
-	if (retval < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		retval = (retval == -EPIPE) ? retval : -EIO;
+	if ((state.mask & AMBXLIGHT_STATE_ENABLED) &&
+	    dev->params.param.enabled != state.enabled) {
+		p[0] = 0xa1;
+		p[1] = 0x00;
+		p[2] = state.enabled;
+		p += sizes[npackets++] = 3;
+	}
+	if ((state.mask & AMBXLIGHT_STATE_LOCATION) &&
+	    dev->params.param.location != state.location) {
+		p[0] = 0xa4;
+		p[1] = 0x00;
+		p[2] = state.location;
+		p[3] = state.location ? 0x00 : 0x01;
+		p += sizes[npackets++] = 4;
+	}
+	if ((state.mask & AMBXLIGHT_STATE_HEIGHT) &&
+	    dev->params.param.height != state.height) {
+		p[0] = 0xa5;
+		p[1] = 0x00;
+		p[2] = state.height;
+		p += sizes[npackets++] = 3;
+	}
+	if ((state.mask & AMBXLIGHT_STATE_INTENSITY) &&
+	    dev->params.param.intensity != state.intensity) {
+		p[0] = 0xa6;
+		p[1] = 0x00;
+		p[2] = state.intensity;
+		p += sizes[npackets++] = 3;
+	}
+	/* the fade only matters on the way to a new color */
+	if ((state.mask & AMBXLIGHT_STATE_COLOR) &&
+	    (!dev->color_known || dev->color[2] != state.red ||
+	     dev->color[3] != state.green || dev->color[4] != state.blue)) {
+		ambxlight_pack_color(p, state.red, state.green, state.blue,
+				     state.fade);
+		p += sizes[npackets++] = AMBXLIGHT_COLOR_REPORT;
 	}
 	spin_unlock_irq(&dev->err_lock);
-	if (retval < 0)
-		goto error;
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
+	retval = 0;
+	if (npackets) {
+		retval = ambx_light_submit_reports(dev, buf, sizes, npackets,
+						   nonblock, false);
+		if (retval >= 0)
+			retval = retval < npackets ? -EIO : 0;
 	}
 
-	buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
-			&urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
-	}
-	((char *)buf)[0] = 0xa7;
-	((char *)buf)[1] = 0x00;
+	mutex_unlock(&dev->state_mutex);
+	return retval;
+}
 
-	/* this lock makes sure we don't submit URBs to gone devices */
-	mutex_lock(&dev->io_mutex);
-	if (!dev->interface) {		/* disconnect() was called */
-		mutex_unlock(&dev->io_mutex);
-		retval = -ENODEV;
-		goto error;
+static int ambx_light_set_group(struct usb_ambx_light *dev,
+				const struct ambxlight_group __user *arg)
+{
+	struct ambxlight_group group;
+	unsigned int i, j;
+
+	if (copy_from_user(&group, arg, sizeof(group)))
+		return -EFAULT;
+	if (group.count > AMBXLIGHT_GROUP_MAX)
+		return -EINVAL;
+
+	/* a pod listed twice would be locked twice */
+	for (i = 0; i < group.count; i++) {
+		if (group.minors[i] < 0)
+			return -EINVAL;
+		for (j = 0; j < i; j++)
+			if (group.minors[i] == group.minors[j])
+				return -EINVAL;
 	}
 
-	/* initialize the urb properly */
-	dev->ctrl_dr = kmalloc(sizeof(struct usb_ctrlrequest), GFP_KERNEL);
-	if (!dev->ctrl_dr) {
-		retval = -ENOMEM;
-		goto error;
-	}
-	dev->ctrl_dr->bRequestType = 0x21;
-	dev->ctrl_dr->bRequest = 0x09;
-	dev->ctrl_dr->wValue = (buf[0] & 0xff);
-	dev->ctrl_dr->wIndex = 0x03;
-	dev->ctrl_dr->wLength = writesize;
+	mutex_lock(&dev->group_mutex);
+	memcpy(dev->group_minors, group.minors, sizeof(group.minors));
+	dev->group_count = group.count;
+	mutex_unlock(&dev->group_mutex);
+	return 0;
+}
 
-	usb_fill_control_urb(urb, dev->udev,
-			  usb_sndctrlpipe(dev->udev, 0),
-			  (unsigned char*)dev->ctrl_dr,
-			  buf,
-			  writesize,
-			  ambx_light_write_ctrl_callback,
-			  dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+/*
+ * char device minor of /dev/ambx_lightN. the usb core ignores minor_base
+ * and packs the minors from 0 when it hands them out dynamically.
+ */
+static int ambx_light_node_minor(int node)
+{
+	if (IS_ENABLED(CONFIG_USB_DYNAMIC_MINORS))
+		return node;
+	return node + CYBORG_AMBX_LIGHT_MINOR_BASE;
+}
 
-	/* send the data out the ctrl port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&dev->io_mutex);
-	if (retval) {
-		dev_err(&dev->interface->dev,
-			"%s - failed submitting write urb, error %d\n",
-			__func__, retval);
-		goto error_unanchor;
+/*
+ * send one color to every pod of the group. a slot is reserved and filled
+ * on each pod first, then all urbs are submitted back to back without
+ * being preempted, so they land in as few usb frames as possible. control
+ * transfers can't be pinned to a frame number, the spread is measured
+ * instead and exported as the group_* counters.
+ */
+static int ambx_light_group_frame(struct usb_ambx_light *dev,
+				  const struct ambxlight_group_frame __user *arg,
+				  bool nonblock)
+{
+	struct ambxlight_group_frame frame;
+	struct usb_ambx_light *members[AMBXLIGHT_GROUP_MAX];
+	struct ambx_light_slot *slots[AMBXLIGHT_GROUP_MAX];
+	struct usb_interface *interface;
+	struct ambxlight_keyframe *color;
+	ktime_t first, last;
+	int first_frame, last_frame;
+	unsigned int nmembers = 0, nstaged = 0, nlocked = 0, nsubmitted = 0;
+	unsigned int i;
+	long skew;
+	int retval = 0;
+
+	if (copy_from_user(&frame, arg, sizeof(frame)))
+		return -EFAULT;
+
+	mutex_lock(&dev->group_mutex);
+	if (!frame.count || frame.count != dev->group_count) {
+		mutex_unlock(&dev->group_mutex);
+		return -EINVAL;
+	}
+	if (mutex_lock_interruptible(&ambx_light_group_lock)) {
+		mutex_unlock(&dev->group_mutex);
+		return -ERESTARTSYS;
 	}
 
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
+	/* look the pods up like open() does and hold on to them */
+	for (nmembers = 0; nmembers < frame.count; nmembers++) {
+		interface = usb_find_interface(&ambx_light_driver,
+				ambx_light_node_minor(dev->group_minors[nmembers]));
+		members[nmembers] = interface ? usb_get_intfdata(interface) : NULL;
+		if (!members[nmembers]) {
+			retval = -ENODEV;
+			goto exit;
+		}
+		kref_get(&members[nmembers]->kref);
+	}
 
+	/* stage the whole frame before anything goes out */
+	for (nstaged = 0; nstaged < nmembers; nstaged++) {
+		retval = ambx_light_reserve_slots(members[nstaged], 1, nonblock);
+		if (retval == -EAGAIN)
+			atomic_long_inc(&members[nstaged]->stats.eagain);
+		if (retval)
+			goto exit;
 
-	return writesize;
+		color = &frame.colors[nstaged];
+		slots[nstaged] = ambx_light_get_slot(members[nstaged]);
+		ambxlight_pack_color(slots[nstaged]->buf, color->red,
+				     color->green, color->blue, color->fade);
+		ambx_light_fill_write_urb(members[nstaged], slots[nstaged],
+					  AMBXLIGHT_COLOR_REPORT);
+	}
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-		usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-		usb_free_urb(urb);
+	/* these locks make sure we don't submit URBs to gone devices */
+	for (nlocked = 0; nlocked < nmembers; nlocked++) {
+		mutex_lock_nested(&members[nlocked]->io_mutex, nlocked);
+		if (!members[nlocked]->interface) {
+			mutex_unlock(&members[nlocked]->io_mutex);
+			retval = -ENODEV;
+			goto exit;
+		}
 	}
-	up(&dev->limit_sem);
+
+	preempt_disable();
+	first = ktime_get();
+	first_frame = usb_get_current_frame_number(members[0]->udev);
+	for (nsubmitted = 0; nsubmitted < nmembers; nsubmitted++) {
+		retval = ambx_light_submit_slot(slots[nsubmitted], GFP_ATOMIC);
+		if (retval)
+			break;
+	}
+	last_frame = usb_get_current_frame_number(members[0]->udev);
+	last = ktime_get();
+	preempt_enable();
+
+	skew = ktime_to_ns(ktime_sub(last, first));
+	atomic_long_inc(&dev->stats.group_frames);
+	atomic_long_set(&dev->stats.group_skew, skew);
+	if (skew > atomic_long_read(&dev->stats.group_skew_max))
+		atomic_long_set(&dev->stats.group_skew_max, skew);
+	if (first_frame != last_frame)
+		atomic_long_inc(&dev->stats.group_frame_spans);
 
 exit:
+	for (i = 0; i < nlocked; i++)
+		mutex_unlock(&members[i]->io_mutex);
+	/* slots that didn't go out go back to their pool */
+	for (i = nsubmitted; i < nstaged; i++)
+		ambx_light_put_slot(slots[i]);
+	for (i = 0; i < nmembers; i++)
+		kref_put(&members[i]->kref, ambx_light_delete);
+	mutex_unlock(&ambx_light_group_lock);
+	mutex_unlock(&dev->group_mutex);
 	return retval;
 }
 
+/* pop the oldest outcome of a scheduled color */
+static int ambx_light_get_lateness(struct usb_ambx_light *dev,
+				   struct ambxlight_lateness __user *arg)
+{
+	struct ambxlight_lateness report;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->schedule_lock, flags);
+	if (!dev->lateness_count) {
+		spin_unlock_irqrestore(&dev->schedule_lock, flags);
+		return -EAGAIN;
+	}
+	report = dev->lateness[dev->lateness_head];
+	dev->lateness_head = (dev->lateness_head + 1) % AMBXLIGHT_SCHEDULE_DEPTH;
+	dev->lateness_count--;
+	spin_unlock_irqrestore(&dev->schedule_lock, flags);
+
+	if (copy_to_user(arg, &report, sizeof(report)))
+		return -EFAULT;
+	return 0;
+}
+
+static int ambx_light_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct usb_ambx_light *dev;
+
+	dev = file_to_ambx_light_dev(file);
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	/* the producer's stores must land in our page, not in a private copy */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(dev->shared) >> PAGE_SHIFT,
+			       vma->vm_end - vma->vm_start,
+			       vma->vm_page_prot);
+}
+
+/*
+ * POLLOUT means a slot of the pool is free (or colors are coalesced and
+ * never wait), POLLIN means read() won't block, i.e. this file has a
+ * snapshot left to read or a newer one has arrived.
+ */
+static unsigned int ambx_light_poll(struct file *file, poll_table *wait)
+{
+	struct ambx_light_file *priv;
+	struct usb_ambx_light *dev;
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	priv = file->private_data;
+	dev = priv->dev;
+
+	poll_wait(file, &dev->wait, wait);
+
+	if (!dev->interface)
+		return POLLERR | POLLHUP;
+
+	spin_lock_irqsave(&dev->slot_lock, flags);
+	if (!list_empty(&dev->free_slots) || dev->coalesce ||
+	    dev->transfer_mode == AMBXLIGHT_MODE_STREAM)
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_irqrestore(&dev->slot_lock, flags);
+
+	if (priv->outbyte || priv->eof ||
+	    ambx_light_params_newer(dev, priv->params_generation) ||
+	    ambx_light_params_failed(dev, priv->params_failures))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
 static long ambx_light_ioctl(struct file *file, unsigned int cmd,
 			  unsigned long arg)
 {
 	struct usb_ambx_light *dev;
 	int retval = 0;
 	unsigned char mode;
+	unsigned int period;
+
+	dev = file_to_ambx_light_dev(file);
 
-	dev = file->private_data;
+	/* these may sleep, handle them before taking err_lock */
+	switch (cmd) {
+		case AMBXLIGHT_IOCTL_KICK:
+			return ambx_light_pick_shared(dev);
+		case AMBXLIGHT_IOCTL_POLL:
+			if (copy_from_user(&period, (const unsigned int *)arg, sizeof(period)))
+				return -EFAULT;
+			/* don't arm the pickup for a gone device */
+			mutex_lock(&dev->io_mutex);
+			if (!dev->interface) {
+				mutex_unlock(&dev->io_mutex);
+				return -ENODEV;
+			}
+			dev->shared_period = period;
+			if (period)
+				mod_delayed_work(system_wq, &dev->shared_work, 0);
+			mutex_unlock(&dev->io_mutex);
+			return 0;
+		case AMBXLIGHT_IOCTL_EFFECT:
+			return ambx_light_set_effect(dev,
+				(const struct ambxlight_effect __user *)arg);
+		case AMBXLIGHT_IOCTL_LATENESS:
+			return ambx_light_get_lateness(dev,
+				(struct ambxlight_lateness __user *)arg);
+		case AMBXLIGHT_IOCTL_TOLERANCE:
+			if (copy_from_user(&period, (const unsigned int *)arg, sizeof(period)))
+				return -EFAULT;
+			if (period < AMBXLIGHT_TOLERANCE_MIN ||
+			    period > AMBXLIGHT_TOLERANCE_MAX)
+				return -EINVAL;
+			dev->schedule_tolerance = period;
+			return 0;
+		case AMBXLIGHT_IOCTL_STATE:
+			return ambx_light_set_state(dev,
+				(const struct ambxlight_state __user *)arg,
+				file->f_flags & O_NONBLOCK);
+		case AMBXLIGHT_IOCTL_GROUP:
+			return ambx_light_set_group(dev,
+				(const struct ambxlight_group __user *)arg);
+		case AMBXLIGHT_IOCTL_GROUP_FRAME:
+			return ambx_light_group_frame(dev,
+				(const struct ambxlight_group_frame __user *)arg,
+				file->f_flags & O_NONBLOCK);
+		case AMBXLIGHT_IOCTL_RATE:
+			if (copy_from_user(&period, (const unsigned int *)arg, sizeof(period)))
+				return -EFAULT;
+			/* the bus takes a control transfer per frame at best */
+			if (period > AMBXLIGHT_RATE_MAX)
+				return -EINVAL;
+			dev->hex_rate = period;
+			return 0;
+		case AMBXLIGHT_IOCTL_COALESCE:
+			if (copy_from_user(&mode, (const char *)arg, sizeof(mode)))
+				return -EFAULT;
+			spin_lock_irq(&dev->err_lock);
+			dev->coalesce = mode;
+			spin_unlock_irq(&dev->err_lock);
+			return 0;
+	}
 
 	spin_lock_irq(&dev->err_lock);
 	switch (cmd) {
@@ -763,6 +2134,12 @@ static long ambx_light_ioctl(struct file *file, unsigned int cmd,
 				break;
 			}
 			dev->transfer_mode = mode;
+			/* selecting streaming again retries the endpoint */
+			if (mode == AMBXLIGHT_MODE_STREAM) {
+				spin_lock(&dev->stream_lock);
+				dev->stream_broken = false;
+				spin_unlock(&dev->stream_lock);
+			}
 			break;
 		case AMBXLIGHT_IOCTL_GET:
 			retval = copy_to_user((char *)arg, &dev->transfer_mode, sizeof(dev->transfer_mode));
@@ -779,8 +2156,10 @@ static const struct file_operations ambx_light_fops = {
 	.owner =	THIS_MODULE,
 	.read =		ambx_light_read,
 	.write =	ambx_light_write,
+	.poll =		ambx_light_poll,
 	.open =		ambx_light_open,
 	.unlocked_ioctl =	ambx_light_ioctl,
+	.mmap =		ambx_light_mmap,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl =	ambx_light_ioctl,
 #endif
@@ -799,14 +2178,109 @@ static struct usb_class_driver ambx_light_class = {
 	.minor_base =	CYBORG_AMBX_LIGHT_MINOR_BASE,
 };
 
+/*
+ * performance counters, exported as a sysfs attribute group on the
+ * interface
+ */
+#define AMBX_LIGHT_STAT_ATTR(_name, _field)				\
+static ssize_t _name##_show(struct device *d,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_ambx_light *dev = usb_get_intfdata(to_usb_interface(d)); \
+									\
+	return sprintf(buf, "%ld\n", atomic_long_read(&dev->stats._field)); \
+}									\
+static DEVICE_ATTR_RO(_name)
+
+AMBX_LIGHT_STAT_ATTR(urbs_submitted, submitted);
+AMBX_LIGHT_STAT_ATTR(urbs_completed, completed);
+AMBX_LIGHT_STAT_ATTR(urbs_failed, failed);
+AMBX_LIGHT_STAT_ATTR(eagain, eagain);
+AMBX_LIGHT_STAT_ATTR(colors_dropped, dropped);
+AMBX_LIGHT_STAT_ATTR(bytes_sent, bytes_sent);
+AMBX_LIGHT_STAT_ATTR(group_frames, group_frames);
+AMBX_LIGHT_STAT_ATTR(group_skew_ns, group_skew);
+AMBX_LIGHT_STAT_ATTR(group_skew_max_ns, group_skew_max);
+AMBX_LIGHT_STAT_ATTR(group_frame_spans, group_frame_spans);
+AMBX_LIGHT_STAT_ATTR(streamed, streamed);
+AMBX_LIGHT_STAT_ATTR(stream_fallbacks, stream_fallbacks);
+
+static ssize_t in_flight_show(struct device *d,
+			      struct device_attribute *attr, char *buf)
+{
+	struct usb_ambx_light *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", atomic_read(&dev->stats.in_flight));
+}
+static DEVICE_ATTR_RO(in_flight);
+
+static ssize_t writes_in_flight_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", WRITES_IN_FLIGHT);
+}
+static DEVICE_ATTR_RO(writes_in_flight);
+
+static ssize_t allocations_show(struct device *d,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_ambx_light *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", atomic_read(&dev->allocations));
+}
+static DEVICE_ATTR_RO(allocations);
+
+/* one line per bucket, the upper bound in usec and the count */
+static ssize_t latency_histogram_show(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	struct usb_ambx_light *dev = usb_get_intfdata(to_usb_interface(d));
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+		len += sprintf(buf + len, "<%lu %ld\n", 1UL << i,
+			       atomic_long_read(&dev->stats.latency[i]));
+	len += sprintf(buf + len, ">=%lu %ld\n", 1UL << (i - 1),
+		       atomic_long_read(&dev->stats.latency[i]));
+
+	return len;
+}
+static DEVICE_ATTR_RO(latency_histogram);
+
+static struct attribute *ambx_light_stats_attrs[] = {
+	&dev_attr_urbs_submitted.attr,
+	&dev_attr_urbs_completed.attr,
+	&dev_attr_urbs_failed.attr,
+	&dev_attr_eagain.attr,
+	&dev_attr_colors_dropped.attr,
+	&dev_attr_bytes_sent.attr,
+	&dev_attr_in_flight.attr,
+	&dev_attr_writes_in_flight.attr,
+	&dev_attr_allocations.attr,
+	&dev_attr_latency_histogram.attr,
+	&dev_attr_group_frames.attr,
+	&dev_attr_group_skew_ns.attr,
+	&dev_attr_group_skew_max_ns.attr,
+	&dev_attr_group_frame_spans.attr,
+	&dev_attr_streamed.attr,
+	&dev_attr_stream_fallbacks.attr,
+	NULL,
+};
+
+static const struct attribute_group ambx_light_stats_group = {
+	.name = "stats",
+	.attrs = ambx_light_stats_attrs,
+};
+
 static int ambx_light_probe(struct usb_interface *interface,
 		      const struct usb_device_id *id)
 {
 	struct usb_ambx_light *dev;
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
-	size_t buffer_size;
 	int retval = -ENOMEM;
+	int i;
 	char proc_dir_name[8];
 	static const struct file_operations proc_fops = {
 		.owner = THIS_MODULE,
@@ -822,48 +2296,97 @@ static int ambx_light_probe(struct usb_interface *interface,
 	kref_init(&dev->kref);
 	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
 	mutex_init(&dev->io_mutex);
+	mutex_init(&dev->batch_mutex);
+	mutex_init(&dev->shared_mutex);
+	mutex_init(&dev->state_mutex);
+	mutex_init(&dev->group_mutex);
+	INIT_DELAYED_WORK(&dev->shared_work, ambx_light_shared_work);
+	INIT_DELAYED_WORK(&dev->params_work, ambx_light_params_work);
+	spin_lock_init(&dev->effect_lock);
+	hrtimer_init(&dev->effect_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->effect_timer.function = ambx_light_effect_timer;
+	spin_lock_init(&dev->schedule_lock);
+	hrtimer_init(&dev->schedule_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->schedule_timer.function = ambx_light_schedule_timer;
+	dev->schedule_tolerance = SCHEDULE_TOLERANCE;
 	spin_lock_init(&dev->err_lock);
+	spin_lock_init(&dev->slot_lock);
+	spin_lock_init(&dev->stream_lock);
 	init_usb_anchor(&dev->submitted);
+	init_waitqueue_head(&dev->wait);
 
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
 
+	/* preallocate the urbs used by write and parameter reads */
+	retval = ambx_light_alloc_slots(dev);
+	if (retval) {
+		dev_err(&interface->dev,
+				"Could not allocate urb pool\n");
+		goto error;
+	}
+	retval = -ENOMEM;
+
+	/* the color register userspace may map */
+	dev->shared = (struct ambxlight_shared *)get_zeroed_page(GFP_KERNEL);
+	if (!dev->shared) {
+		dev_err(&interface->dev,
+				"Could not allocate shared register\n");
+		goto error;
+	}
+
 	/* set up the endpoint information */
-	/* use only the first endpoints */
+	/* the first interrupt out endpoint carries AMBXLIGHT_MODE_STREAM */
 	iface_desc = interface->cur_altsetting;
-	if (iface_desc->desc.bNumEndpoints == 1) {
-		endpoint = &iface_desc->endpoint[0].desc;
-		buffer_size = usb_endpoint_maxp(endpoint);
-		dev->ctrl_size = buffer_size;
-		dev->ctrl_endpointAddr = endpoint->bEndpointAddress;
-		dev->ctrl_buffer = kmalloc(buffer_size, GFP_KERNEL);
-		if (!dev->ctrl_buffer) {
-			dev_err(&interface->dev,
-					"Could not allocate ctrl_buffer\n");
-			goto error;
-		}
-		dev->ctrl_urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!dev->ctrl_urb) {
-			dev_err(&interface->dev,
-					"Could not allocate ctrl_urb\n");
-			goto error;
+	for (i = 0; i < iface_desc->desc.bNumEndpoints; i++) {
+		endpoint = &iface_desc->endpoint[i].desc;
+		if (usb_endpoint_is_int_out(endpoint) &&
+		    usb_endpoint_maxp(endpoint) >= AMBXLIGHT_COLOR_REPORT)
+			break;
+	}
+	if (i < iface_desc->desc.bNumEndpoints) {
+		for (i = 0; i < STREAM_URBS; i++) {
+			retval = ambx_light_alloc_slot(dev, &dev->stream[i]);
+			if (retval) {
+				dev_err(&interface->dev,
+						"Could not allocate stream ring\n");
+				goto error;
+			}
 		}
+		retval = -ENOMEM;
+		dev->stream_endpointAddr = endpoint->bEndpointAddress;
+		dev->stream_interval = endpoint->bInterval;
+		dev->stream_idle = BIT(STREAM_URBS) - 1;
 	}
 
 
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
 
+	/* export our counters */
+	retval = sysfs_create_group(&interface->dev.kobj,
+				    &ambx_light_stats_group);
+	if (retval) {
+		dev_err(&interface->dev,
+			"Not able to create the stats attributes.\n");
+		usb_set_intfdata(interface, NULL);
+		goto error;
+	}
+
 	/* we can register the device now, as it is ready */
 	retval = usb_register_dev(interface, &ambx_light_class);
 	if (retval) {
 		/* something prevented us from registering this driver */
 		dev_err(&interface->dev,
 			"Not able to get a minor for this device.\n");
+		sysfs_remove_group(&interface->dev.kobj,
+				   &ambx_light_stats_group);
 		usb_set_intfdata(interface, NULL);
 		goto error;
 	}
 
+	dev->minor = interface->minor;
+
 	/* let the user know what node this device is now attached to */
 	dev_info(&interface->dev,
 		 "Cyborg amBX Light Pods device now attached to amBXLight-%d",
@@ -878,7 +2401,8 @@ static int ambx_light_probe(struct usb_interface *interface,
 			(proc_create_data(PROC_INTENSITY_ENTRY, 0, dev->proc_dir, &proc_fops, dev) == NULL) ||
 			(proc_create_data(PROC_LOCATION_ENTRY, 0, dev->proc_dir, &proc_fops, dev) == NULL) ||
 			(proc_create_data(PROC_HEIGHT_ENTRY, 0, dev->proc_dir, &proc_fops, dev) == NULL) ||
-			(proc_create_data(PROC_ENABLED_ENTRY, 0, dev->proc_dir, &proc_fops, dev) == NULL)
+			(proc_create_data(PROC_ENABLED_ENTRY, 0, dev->proc_dir, &proc_fops, dev) == NULL) ||
+			(proc_create_data(PROC_ALLOCATIONS_ENTRY, 0, dev->proc_dir, &proc_fops, dev) == NULL)
 	   ){
 		dev_err(&interface->dev,
 			"%s - create_proc_entry failed\n",
@@ -887,7 +2411,7 @@ static int ambx_light_probe(struct usb_interface *interface,
 		return -EBUSY;
 	}
 
-	ambx_light_pre_get_params(dev);
+	ambx_light_request_refresh(dev, 0);
 	return 0;
 
 error:
@@ -902,8 +2426,10 @@ static void ambx_light_disconnect(struct usb_interface *interface)
 	struct usb_ambx_light *dev;
 	int minor = interface->minor;
 	char proc_dir_name[8];
+	int i;
 
 	dev = usb_get_intfdata(interface);
+	sysfs_remove_group(&interface->dev.kobj, &ambx_light_stats_group);
 	usb_set_intfdata(interface, NULL);
 
 	/* remove proc entries */
@@ -911,6 +2437,7 @@ static void ambx_light_disconnect(struct usb_interface *interface)
 	remove_proc_entry(PROC_LOCATION_ENTRY, dev->proc_dir);
 	remove_proc_entry(PROC_HEIGHT_ENTRY, dev->proc_dir);
 	remove_proc_entry(PROC_ENABLED_ENTRY, dev->proc_dir);
+	remove_proc_entry(PROC_ALLOCATIONS_ENTRY, dev->proc_dir);
 
 	/* remove proc directory */
 	sprintf(proc_dir_name, PROC_LIGHT_DIR "%d", interface->minor);
@@ -924,8 +2451,26 @@ static void ambx_light_disconnect(struct usb_interface *interface)
 	dev->interface = NULL;
 	mutex_unlock(&dev->io_mutex);
 
+	/* wake up pollers, they will see the device is gone */
+	wake_up_interruptible_all(&dev->wait);
+
+	/* stop picking up the shared register and playing effects */
+	dev->shared_period = 0;
+	cancel_delayed_work_sync(&dev->shared_work);
+	hrtimer_cancel(&dev->effect_timer);
+	hrtimer_cancel(&dev->schedule_timer);
+
+	/* completion handlers resubmit parked colors, stop them for good */
+	for (i = 0; i < WRITES_IN_FLIGHT; i++)
+		usb_poison_urb(dev->slots[i].urb);
+	for (i = 0; i < STREAM_URBS; i++)
+		usb_poison_urb(dev->stream[i].urb);
+
 	usb_kill_anchored_urbs(&dev->submitted);
 
+	/* no completion can schedule a refresh anymore */
+	cancel_delayed_work_sync(&dev->params_work);
+
 	/* decrement our usage count */
 	kref_put(&dev->kref, ambx_light_delete);
 
@@ -939,7 +2484,6 @@ static void ambx_light_draw_down(struct usb_ambx_light *dev)
 	time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&dev->submitted);
-	usb_kill_urb(dev->ctrl_urb);
 }
 
 static int ambx_light_suspend(struct usb_interface *intf, pm_message_t message)
@@ -0,0 +1,141 @@
+#ifndef _AMBXLIGHT_DECODE_H__
+#define _AMBXLIGHT_DECODE_H__
+
+/*
+ * Decoding of what userspace writes into device reports. Nothing in here
+ * touches a device, the functions only look at their arguments, so they
+ * can be exercised without hardware.
+ */
+
+#include <linux/types.h>
+#include <linux/errno.h>
+
+/* the RAW framing, shared with the library's usbfs transport */
+#include "../include/libambxlight/raw.h"
+
+/* HEXSTRING/HEXSTREAM character classes, the low nibble of a digit is its value */
+#define HEX_DIGIT	0x10
+#define HEX_EOL		0x20
+#define HEX_BLANK	0x40
+
+static const unsigned char ambxlight_hex_class[256] = {
+	['0'] = HEX_DIGIT | 0x0, ['1'] = HEX_DIGIT | 0x1,
+	['2'] = HEX_DIGIT | 0x2, ['3'] = HEX_DIGIT | 0x3,
+	['4'] = HEX_DIGIT | 0x4, ['5'] = HEX_DIGIT | 0x5,
+	['6'] = HEX_DIGIT | 0x6, ['7'] = HEX_DIGIT | 0x7,
+	['8'] = HEX_DIGIT | 0x8, ['9'] = HEX_DIGIT | 0x9,
+	['a'] = HEX_DIGIT | 0xa, ['b'] = HEX_DIGIT | 0xb,
+	['c'] = HEX_DIGIT | 0xc, ['d'] = HEX_DIGIT | 0xd,
+	['e'] = HEX_DIGIT | 0xe, ['f'] = HEX_DIGIT | 0xf,
+	['A'] = HEX_DIGIT | 0xa, ['B'] = HEX_DIGIT | 0xb,
+	['C'] = HEX_DIGIT | 0xc, ['D'] = HEX_DIGIT | 0xd,
+	['E'] = HEX_DIGIT | 0xe, ['F'] = HEX_DIGIT | 0xf,
+	['\n'] = HEX_EOL,
+	['\r'] = HEX_BLANK, ['\t'] = HEX_BLANK, [' '] = HEX_BLANK, ['#'] = HEX_BLANK,
+};
+
+/* state of a HEXSTREAM parser, zeroed to start */
+struct ambxlight_hex_parser {
+	unsigned char	color[3];	/* color of the line being parsed */
+	unsigned int	digits;		/* digits of the line seen so far */
+	bool		bad;		/* line holds garbage, skip to its end */
+};
+
+/* build a 0xa2 color report in report */
+static inline void ambxlight_pack_color(unsigned char *report,
+					unsigned char r, unsigned char g,
+					unsigned char b, unsigned int fade)
+{
+	report[0] = 0xa2;
+	report[1] = 0x00;
+	report[2] = r;
+	report[3] = g;
+	report[4] = b;
+	report[5] = fade & 0xff;
+	report[6] = (fade >> 8) & 0xff;
+	report[7] = 0x00;
+	report[8] = 0x00;
+}
+
+/*
+ * decode the six hex digits of a HEXSTRING write into rgb. rgb may be the
+ * same buffer as hex.
+ */
+static inline int ambxlight_decode_hexstring(const unsigned char *hex,
+					     unsigned char *rgb)
+{
+	unsigned char hi, lo;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		hi = ambxlight_hex_class[hex[2 * i]];
+		lo = ambxlight_hex_class[hex[2 * i + 1]];
+		if (!(hi & lo & HEX_DIGIT))
+			return -EFAULT;
+		rgb[i] = (hi & 0x0f) << 4 | (lo & 0x0f);
+	}
+	return 0;
+}
+
+/*
+ * feed one byte of a HEXSTREAM to a parser. returns true when it ends a
+ * line of exactly six digits, the color is then in parser->color. lines
+ * with anything else are skipped whole.
+ */
+static inline bool ambxlight_hex_feed(struct ambxlight_hex_parser *parser,
+				      unsigned char c)
+{
+	unsigned char class = ambxlight_hex_class[c];
+	bool complete;
+
+	if (class & HEX_DIGIT) {
+		if (parser->digits == 6) {
+			parser->bad = true;
+			return false;
+		}
+		if (parser->digits % 2)
+			parser->color[parser->digits / 2] |= class & 0x0f;
+		else
+			parser->color[parser->digits / 2] = (class & 0x0f) << 4;
+		parser->digits++;
+		return false;
+	}
+
+	if (class & HEX_EOL) {
+		complete = parser->digits == 6 && !parser->bad;
+		parser->digits = 0;
+		parser->bad = false;
+		return complete;
+	}
+
+	if (!(class & HEX_BLANK))
+		parser->bad = true;
+	return false;
+}
+
+/*
+ * split a RAW write into the reports laid out back to back in it. returns
+ * the number of reports, their sizes in sizes, or -EFAULT if the write
+ * holds anything else or more than max_packets of them.
+ */
+static inline int ambxlight_decode_raw(const unsigned char *buf, size_t len,
+				       size_t *sizes, int max_packets,
+				       size_t max)
+{
+	size_t offset;
+	int npackets = 0;
+	int size;
+
+	for (offset = 0; offset < len; offset += size) {
+		if (npackets == max_packets)
+			return -EFAULT;
+		size = ambxlight_raw_packet_size(&buf[offset], len - offset,
+						 max);
+		if (size < 0)
+			return size;
+		sizes[npackets++] = size;
+	}
+	return npackets;
+}
+
+#endif
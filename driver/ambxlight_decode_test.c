@@ -0,0 +1,396 @@
+/*
+ * KUnit tests and microbenchmarks for the amBX light write decoders
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * The decoders in ambxlight_decode.h only look at their arguments, so
+ * they run without a pod or even USB, for instance under UML:
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=<this directory>
+ *
+ * with this directory copied into the kernel tree and its Kconfig sourced.
+ * Out of tree, "make kunit" builds ambxlight_decode_test.ko, which runs
+ * the suites when loaded on a kernel with CONFIG_KUNIT.
+ *
+ * The ambxlight_decode_bench suite times the decode step and reports the
+ * cost per packet with kunit_info(), it only fails if a decoder does.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ctype.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+
+#include "ambxlight_params.h"
+#include "ambxlight_decode.h"
+
+#define BENCH_ITERATIONS	100000
+#define BENCH_TRANSFER		64	/* MAX_TRANSFER in the driver */
+#define BENCH_PACKETS		8	/* WRITES_IN_FLIGHT in the driver */
+
+/* feed a whole string, returns the number of colors it completed */
+static int hex_feed_string(struct ambxlight_hex_parser *parser,
+			   const char *s)
+{
+	int colors = 0;
+
+	while (*s)
+		colors += ambxlight_hex_feed(parser, *s++);
+	return colors;
+}
+
+static void ambxlight_hex_class_test(struct kunit *test)
+{
+	const char *digits = "0123456789abcdef";
+	int c;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		KUNIT_EXPECT_EQ(test, ambxlight_hex_class[(unsigned char)digits[i]],
+				HEX_DIGIT | i);
+		KUNIT_EXPECT_EQ(test, ambxlight_hex_class[toupper(digits[i])],
+				HEX_DIGIT | i);
+	}
+
+	KUNIT_EXPECT_EQ(test, ambxlight_hex_class['\n'], HEX_EOL);
+	KUNIT_EXPECT_EQ(test, ambxlight_hex_class['\r'], HEX_BLANK);
+	KUNIT_EXPECT_EQ(test, ambxlight_hex_class['\t'], HEX_BLANK);
+	KUNIT_EXPECT_EQ(test, ambxlight_hex_class[' '], HEX_BLANK);
+	KUNIT_EXPECT_EQ(test, ambxlight_hex_class['#'], HEX_BLANK);
+
+	/* everything else is garbage */
+	for (c = 0; c < 256; c++) {
+		if (isxdigit(c) || strchr("\n\r\t #", c))
+			continue;
+		KUNIT_EXPECT_EQ(test, ambxlight_hex_class[c], 0);
+	}
+}
+
+static void ambxlight_pack_color_test(struct kunit *test)
+{
+	static const unsigned char expected[AMBXLIGHT_COLOR_REPORT] = {
+		0xa2, 0x00, 0x12, 0x34, 0x56, 0x34, 0x12, 0x00, 0x00,
+	};
+	unsigned char report[AMBXLIGHT_COLOR_REPORT];
+
+	memset(report, 0xff, sizeof(report));
+	ambxlight_pack_color(report, 0x12, 0x34, 0x56, 0x1234);
+	KUNIT_EXPECT_EQ(test, memcmp(report, expected, sizeof(report)), 0);
+}
+
+static void ambxlight_decode_hexstring_test(struct kunit *test)
+{
+	unsigned char hex[6];
+	unsigned char rgb[3];
+
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"ff8001", rgb), 0);
+	KUNIT_EXPECT_EQ(test, rgb[0], 0xff);
+	KUNIT_EXPECT_EQ(test, rgb[1], 0x80);
+	KUNIT_EXPECT_EQ(test, rgb[2], 0x01);
+
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"A0b0C0", rgb), 0);
+	KUNIT_EXPECT_EQ(test, rgb[0], 0xa0);
+	KUNIT_EXPECT_EQ(test, rgb[1], 0xb0);
+	KUNIT_EXPECT_EQ(test, rgb[2], 0xc0);
+
+	/* decoding in place, as ambx_light_write() does */
+	memcpy(hex, "123456", sizeof(hex));
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring(hex, hex), 0);
+	KUNIT_EXPECT_EQ(test, hex[0], 0x12);
+	KUNIT_EXPECT_EQ(test, hex[1], 0x34);
+	KUNIT_EXPECT_EQ(test, hex[2], 0x56);
+
+	/* a bad digit anywhere, in either nibble */
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"g00000", rgb), -EFAULT);
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"0g0000", rgb), -EFAULT);
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"00000 ", rgb), -EFAULT);
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"0000\n0", rgb), -EFAULT);
+}
+
+static void ambxlight_hex_feed_test(struct kunit *test)
+{
+	struct ambxlight_hex_parser parser;
+
+	memset(&parser, 0, sizeof(parser));
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "ff0080\n"), 1);
+	KUNIT_EXPECT_EQ(test, parser.color[0], 0xff);
+	KUNIT_EXPECT_EQ(test, parser.color[1], 0x00);
+	KUNIT_EXPECT_EQ(test, parser.color[2], 0x80);
+
+	/* blanks, a leading # and CRLF are allowed */
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, " #12 34\t56\r\n"), 1);
+	KUNIT_EXPECT_EQ(test, parser.color[0], 0x12);
+	KUNIT_EXPECT_EQ(test, parser.color[1], 0x34);
+	KUNIT_EXPECT_EQ(test, parser.color[2], 0x56);
+
+	/* empty lines complete nothing */
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "\n\n"), 0);
+}
+
+static void ambxlight_hex_feed_odd_length_test(struct kunit *test)
+{
+	struct ambxlight_hex_parser parser;
+
+	memset(&parser, 0, sizeof(parser));
+
+	/* too short, too long, odd lengths on both sides */
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "12345\n"), 0);
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "1234567\n"), 0);
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "12345678\n"), 0);
+
+	/* a bad line doesn't spill into the next one */
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "abcdef\n"), 1);
+	KUNIT_EXPECT_EQ(test, parser.digits, 0U);
+	KUNIT_EXPECT_FALSE(test, parser.bad);
+}
+
+static void ambxlight_hex_feed_invalid_test(struct kunit *test)
+{
+	struct ambxlight_hex_parser parser;
+
+	memset(&parser, 0, sizeof(parser));
+
+	/* garbage anywhere skips the whole line */
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "12x456\n"), 0);
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "123456z\n"), 0);
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "-123456\n"), 0);
+
+	KUNIT_EXPECT_EQ(test, hex_feed_string(&parser, "x\n010203\n"), 1);
+	KUNIT_EXPECT_EQ(test, parser.color[0], 0x01);
+	KUNIT_EXPECT_EQ(test, parser.color[1], 0x02);
+	KUNIT_EXPECT_EQ(test, parser.color[2], 0x03);
+}
+
+static void ambxlight_hex_feed_split_test(struct kunit *test)
+{
+	const char *stream = "102030\n405060\n708090\n";
+	struct ambxlight_hex_parser parser;
+	size_t len = strlen(stream);
+	size_t split, i;
+	int colors;
+
+	/* a write may end anywhere, the parser carries the line over */
+	for (split = 0; split <= len; split++) {
+		memset(&parser, 0, sizeof(parser));
+		colors = 0;
+		for (i = 0; i < split; i++)
+			colors += ambxlight_hex_feed(&parser, stream[i]);
+		colors += hex_feed_string(&parser, stream + split);
+		KUNIT_EXPECT_EQ(test, colors, 3);
+		KUNIT_EXPECT_EQ(test, parser.color[0], 0x70);
+		KUNIT_EXPECT_EQ(test, parser.color[1], 0x80);
+		KUNIT_EXPECT_EQ(test, parser.color[2], 0x90);
+	}
+}
+
+static void ambxlight_raw_packet_size_test(struct kunit *test)
+{
+	unsigned char buf[BENCH_TRANSFER] = { 0 };
+
+	buf[0] = 0xa1;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), 3);
+	buf[0] = 0xa2;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), AMBXLIGHT_COLOR_REPORT);
+	buf[0] = 0xa4;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), 4);
+	buf[0] = 0xa5;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), 3);
+	buf[0] = 0xa6;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), 3);
+	buf[0] = 0xa7;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), 2);
+
+	/* the unknown 0xa3 takes the rest of the write, up to max */
+	buf[0] = 0xa3;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, 20, sizeof(buf)), 20);
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, 20, 16), -EFAULT);
+
+	/* unknown opcodes and a non zero second byte */
+	buf[0] = 0xa0;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), -EFAULT);
+	buf[0] = 0xa8;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), -EFAULT);
+	buf[0] = 0xa2;
+	buf[1] = 0x01;
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), sizeof(buf)), -EFAULT);
+}
+
+static void ambxlight_raw_packet_truncated_test(struct kunit *test)
+{
+	unsigned char buf[AMBXLIGHT_COLOR_REPORT];
+	size_t len;
+
+	ambxlight_pack_color(buf, 1, 2, 3, 0);
+
+	/* a report cut short anywhere is rejected */
+	for (len = 0; len < sizeof(buf); len++)
+		KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, len, 64), -EFAULT);
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), 64), AMBXLIGHT_COLOR_REPORT);
+
+	/* or longer than a transfer buffer */
+	KUNIT_EXPECT_EQ(test, ambxlight_raw_packet_size(buf, sizeof(buf), 8), -EFAULT);
+}
+
+static void ambxlight_decode_raw_test(struct kunit *test)
+{
+	unsigned char buf[32];
+	size_t sizes[4];
+	size_t len = 0;
+
+	ambxlight_pack_color(&buf[len], 1, 2, 3, 0);
+	len += AMBXLIGHT_COLOR_REPORT;
+	buf[len++] = 0xa6;
+	buf[len++] = 0x00;
+	buf[len++] = 0x80;
+	buf[len++] = 0xa4;
+	buf[len++] = 0x00;
+	buf[len++] = LOCATION_NE;
+	buf[len++] = 0x00;
+
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_raw(buf, len, sizes, 4, 64), 3);
+	KUNIT_EXPECT_EQ(test, sizes[0], (size_t)AMBXLIGHT_COLOR_REPORT);
+	KUNIT_EXPECT_EQ(test, sizes[1], (size_t)3);
+	KUNIT_EXPECT_EQ(test, sizes[2], (size_t)4);
+
+	/* more reports than allowed in one write */
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_raw(buf, len, sizes, 2, 64), -EFAULT);
+
+	/* a trailing report cut short fails the whole write */
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_raw(buf, len - 1, sizes, 4, 64), -EFAULT);
+
+	/* nothing to decode */
+	KUNIT_EXPECT_EQ(test, ambxlight_decode_raw(buf, 0, sizes, 4, 64), 0);
+}
+
+static struct kunit_case ambxlight_decode_test_cases[] = {
+	KUNIT_CASE(ambxlight_hex_class_test),
+	KUNIT_CASE(ambxlight_pack_color_test),
+	KUNIT_CASE(ambxlight_decode_hexstring_test),
+	KUNIT_CASE(ambxlight_hex_feed_test),
+	KUNIT_CASE(ambxlight_hex_feed_odd_length_test),
+	KUNIT_CASE(ambxlight_hex_feed_invalid_test),
+	KUNIT_CASE(ambxlight_hex_feed_split_test),
+	KUNIT_CASE(ambxlight_raw_packet_size_test),
+	KUNIT_CASE(ambxlight_raw_packet_truncated_test),
+	KUNIT_CASE(ambxlight_decode_raw_test),
+	{}
+};
+
+static struct kunit_suite ambxlight_decode_test_suite = {
+	.name = "ambxlight_decode",
+	.test_cases = ambxlight_decode_test_cases,
+};
+
+/* report what an operation done count times in ns nanoseconds costs */
+static void ambxlight_bench_report(struct kunit *test, const char *what,
+				   u64 ns, unsigned long count)
+{
+	kunit_info(test, "%s: %llu.%02llu ns per packet\n", what,
+		   div_u64(ns, count), div_u64(ns * 100, count) % 100);
+}
+
+static void ambxlight_bench_hexstring(struct kunit *test)
+{
+	unsigned char rgb[3];
+	unsigned int sum = 0;
+	u64 start;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		KUNIT_ASSERT_EQ(test, ambxlight_decode_hexstring((const unsigned char *)"a1b2c3", rgb), 0);
+		/* keep the compiler from hoisting the decode out of the loop */
+		OPTIMIZER_HIDE_VAR(rgb[0]);
+		sum += rgb[0];
+	}
+	ambxlight_bench_report(test, "HEXSTRING decode",
+			       ktime_get_ns() - start, BENCH_ITERATIONS);
+	KUNIT_EXPECT_EQ(test, sum, 0xa1U * BENCH_ITERATIONS);
+}
+
+static void ambxlight_bench_hex_feed(struct kunit *test)
+{
+	static const char line[] = "a1b2c3\n";
+	struct ambxlight_hex_parser parser;
+	unsigned int colors = 0;
+	u64 start;
+	size_t j;
+	int i;
+
+	memset(&parser, 0, sizeof(parser));
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		for (j = 0; j < sizeof(line) - 1; j++)
+			colors += ambxlight_hex_feed(&parser, line[j]);
+		OPTIMIZER_HIDE_VAR(colors);
+	}
+	ambxlight_bench_report(test, "HEXSTREAM line",
+			       ktime_get_ns() - start, BENCH_ITERATIONS);
+	KUNIT_EXPECT_EQ(test, colors, (unsigned int)BENCH_ITERATIONS);
+}
+
+static void ambxlight_bench_pack_color(struct kunit *test)
+{
+	unsigned char report[AMBXLIGHT_COLOR_REPORT];
+	unsigned char *out = report;
+	u64 start;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		/* the stores can't be dropped through a pointer it can't see */
+		OPTIMIZER_HIDE_VAR(out);
+		ambxlight_pack_color(out, i, i >> 8, i >> 16, i);
+	}
+	ambxlight_bench_report(test, "COLOR pack",
+			       ktime_get_ns() - start, BENCH_ITERATIONS);
+	KUNIT_EXPECT_EQ(test, report[0], 0xa2);
+}
+
+static void ambxlight_bench_decode_raw(struct kunit *test)
+{
+	unsigned char buf[BENCH_PACKETS * AMBXLIGHT_COLOR_REPORT];
+	size_t sizes[BENCH_PACKETS];
+	int npackets = 0;
+	u64 start;
+	int i;
+
+	/* a full RAW batch of colors, the longest write the driver takes */
+	for (i = 0; i < BENCH_PACKETS; i++)
+		ambxlight_pack_color(&buf[i * AMBXLIGHT_COLOR_REPORT], i, i, i, 0);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		npackets = ambxlight_decode_raw(buf, sizeof(buf), sizes,
+						BENCH_PACKETS, BENCH_TRANSFER);
+		OPTIMIZER_HIDE_VAR(npackets);
+	}
+	ambxlight_bench_report(test, "RAW decode",
+			       ktime_get_ns() - start,
+			       (unsigned long)BENCH_ITERATIONS * BENCH_PACKETS);
+	KUNIT_EXPECT_EQ(test, npackets, BENCH_PACKETS);
+}
+
+static struct kunit_case ambxlight_decode_bench_cases[] = {
+	KUNIT_CASE(ambxlight_bench_hexstring),
+	KUNIT_CASE(ambxlight_bench_hex_feed),
+	KUNIT_CASE(ambxlight_bench_pack_color),
+	KUNIT_CASE(ambxlight_bench_decode_raw),
+	{}
+};
+
+static struct kunit_suite ambxlight_decode_bench_suite = {
+	.name = "ambxlight_decode_bench",
+	.test_cases = ambxlight_decode_bench_cases,
+};
+
+kunit_test_suites(&ambxlight_decode_test_suite, &ambxlight_decode_bench_suite);
+
+MODULE_DESCRIPTION("ambxlight decoder tests");
+MODULE_AUTHOR("Yuki Mizuno");
+MODULE_LICENSE("GPL v2");
@@ -2,6 +2,7 @@
 #define _AMBXLIGHT_IOCTL_H__
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define AMBXLIGHT_IOCTL_MAGIC  0xAB
 
@@ -11,11 +12,143 @@
 #define AMBXLIGHT_IOCTL_QUERY  _IOC( _IOC_NONE,  AMBXLIGHT_IOCTL_MAGIC, 0x02, 0) 
 #define AMBXLIGHT_IOCTL_GET    _IOC( _IOC_READ,  AMBXLIGHT_IOCTL_MAGIC, 0x03, sizeof(char))
 #define AMBXLIGHT_IOCTL_RESET  _IOC( _IOC_NONE,  AMBXLIGHT_IOCTL_MAGIC, 0x04, 0)
+#define AMBXLIGHT_IOCTL_COALESCE  _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x05, sizeof(char))
+#define AMBXLIGHT_IOCTL_KICK   _IOC( _IOC_NONE,  AMBXLIGHT_IOCTL_MAGIC, 0x06, 0)
+#define AMBXLIGHT_IOCTL_POLL   _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x07, sizeof(unsigned int))
+#define AMBXLIGHT_IOCTL_EFFECT _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x08, sizeof(struct ambxlight_effect))
+#define AMBXLIGHT_IOCTL_LATENESS  _IOC( _IOC_READ,  AMBXLIGHT_IOCTL_MAGIC, 0x09, sizeof(struct ambxlight_lateness))
+#define AMBXLIGHT_IOCTL_TOLERANCE _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0a, sizeof(unsigned int))
+#define AMBXLIGHT_IOCTL_RATE   _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0b, sizeof(unsigned int))
+#define AMBXLIGHT_IOCTL_STATE  _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0c, sizeof(struct ambxlight_state))
+#define AMBXLIGHT_IOCTL_GROUP  _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0d, sizeof(struct ambxlight_group))
+#define AMBXLIGHT_IOCTL_GROUP_FRAME _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0e, sizeof(struct ambxlight_group_frame))
 
 /* Define transfer mode */
 #define AMBXLIGHT_MODE_RAW	0x01
 #define AMBXLIGHT_MODE_COLOR	0x02
 #define AMBXLIGHT_MODE_HEXSTRING	0x04
+#define AMBXLIGHT_MODE_SCHEDULED	0x08
+#define AMBXLIGHT_MODE_HEXSTREAM	0x10
+#define AMBXLIGHT_MODE_STREAM	0x20
 
+/* Define AMBXLIGHT_IOCTL_TOLERANCE range, usec */
+#define AMBXLIGHT_TOLERANCE_MIN	1
+#define AMBXLIGHT_TOLERANCE_MAX	1000000
+
+/* Define AMBXLIGHT_IOCTL_RATE limit, colors per second, 0 for newest wins */
+#define AMBXLIGHT_RATE_MAX	1000
+
+/* Define effect flags */
+#define AMBXLIGHT_EFFECT_LOOP	0x01
+#define AMBXLIGHT_EFFECT_MAX_FRAMES	64
+
+/* Define state fields */
+#define AMBXLIGHT_STATE_COLOR	0x01
+#define AMBXLIGHT_STATE_ENABLED	0x02
+#define AMBXLIGHT_STATE_LOCATION	0x04
+#define AMBXLIGHT_STATE_HEIGHT	0x08
+#define AMBXLIGHT_STATE_INTENSITY	0x10
+#define AMBXLIGHT_STATE_ALL	0x1f
+
+/* Define scheduled color queue depth */
+#define AMBXLIGHT_SCHEDULE_DEPTH	64
+
+/* Define sync group size */
+#define AMBXLIGHT_GROUP_MAX	8
+
+/*
+ * Shared color register, mapped with mmap() on the device node.
+ * The producer makes sequence odd, stores the color, bumps generation and
+ * makes sequence even again. The driver sends the color on
+ * AMBXLIGHT_IOCTL_KICK or every AMBXLIGHT_IOCTL_POLL msec, but only when
+ * generation has changed.
+ */
+struct ambxlight_shared {
+	__u32 sequence;
+	__u32 generation;
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 reserved;
+	__u16 fade;	/* msec */
+	__u16 reserved2;
+};
+
+/*
+ * Effect program, played by the driver. Each keyframe is sent as a 0xa2
+ * report, the device interpolates towards it over fade msec, then the
+ * color is held for hold msec before the next keyframe is sent.
+ * A program with count 0 stops the running effect.
+ */
+struct ambxlight_keyframe {
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 reserved;
+	__u16 fade;	/* msec */
+	__u16 hold;	/* msec */
+};
+
+struct ambxlight_effect {
+	__u32 flags;
+	__u32 count;
+	struct ambxlight_keyframe frames[AMBXLIGHT_EFFECT_MAX_FRAMES];
+};
+
+/*
+ * Scheduled color, written in AMBXLIGHT_MODE_SCHEDULED. The 0xa2 report is
+ * sent when CLOCK_MONOTONIC reaches timestamp, or dropped if the driver
+ * gets to it later than the tolerance set by AMBXLIGHT_IOCTL_TOLERANCE.
+ */
+struct ambxlight_scheduled {
+	__s64 timestamp;	/* nsec */
+	__u8 report[9];
+	__u8 reserved[7];
+};
+
+/* What became of a scheduled color, read by AMBXLIGHT_IOCTL_LATENESS */
+struct ambxlight_lateness {
+	__s64 timestamp;	/* nsec, the deadline of the entry */
+	__s64 lateness;		/* nsec between the deadline and the submission */
+	__s32 status;		/* 0 if sent, -ETIME if dropped, else submit error */
+	__u32 reserved;
+};
+
+/*
+ * Full pod state for AMBXLIGHT_IOCTL_STATE. Only the fields in mask are
+ * applied, and of those only the ones differing from what the driver last
+ * sent or read back go out to the device.
+ */
+struct ambxlight_state {
+	__u32 mask;		/* AMBXLIGHT_STATE_* */
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 enabled;
+	__u16 fade;		/* msec */
+	__u8 location;
+	__u8 height;
+	__u8 intensity;
+	__u8 reserved[3];
+};
+
+/*
+ * Sync group set with AMBXLIGHT_IOCTL_GROUP. Its pods are given by the N
+ * of their /dev/ambx_lightN node, not by the char device minor.
+ */
+struct ambxlight_group {
+	__u32 count;
+	__s32 minors[AMBXLIGHT_GROUP_MAX];
+};
+
+/*
+ * Group frame for AMBXLIGHT_IOCTL_GROUP_FRAME, one color per pod in group
+ * order. The hold of the keyframes is ignored.
+ */
+struct ambxlight_group_frame {
+	__u32 count;
+	__u32 reserved;
+	struct ambxlight_keyframe colors[AMBXLIGHT_GROUP_MAX];
+};
 
 #endif
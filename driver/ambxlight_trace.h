@@ -0,0 +1,119 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ambxlight
+
+#if !defined(_AMBXLIGHT_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define _AMBXLIGHT_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+#include "ambxlight_ioctl.h"
+
+#define show_transfer_mode(mode)				\
+	__print_symbolic(mode,					\
+		{ AMBXLIGHT_MODE_RAW,		"RAW" },	\
+		{ AMBXLIGHT_MODE_COLOR,		"COLOR" },	\
+		{ AMBXLIGHT_MODE_HEXSTRING,	"HEXSTRING" },	\
+		{ AMBXLIGHT_MODE_SCHEDULED,	"SCHEDULED" },	\
+		{ AMBXLIGHT_MODE_HEXSTREAM,	"HEXSTREAM" },	\
+		{ AMBXLIGHT_MODE_STREAM,	"STREAM" })
+
+TRACE_EVENT(ambxlight_write,
+	TP_PROTO(int minor, size_t count),
+	TP_ARGS(minor, count),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, count)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+	),
+	TP_printk("minor=%d count=%zu", __entry->minor, __entry->count)
+);
+
+TRACE_EVENT(ambxlight_decode,
+	TP_PROTO(int minor, unsigned char mode, int npackets),
+	TP_ARGS(minor, mode, npackets),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned char, mode)
+		__field(int, npackets)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->mode = mode;
+		__entry->npackets = npackets;
+	),
+	TP_printk("minor=%d mode=%s packets=%d", __entry->minor,
+		  show_transfer_mode(__entry->mode), __entry->npackets)
+);
+
+TRACE_EVENT(ambxlight_urb_submit,
+	TP_PROTO(int minor, unsigned char report, unsigned int length,
+		 int retval),
+	TP_ARGS(minor, report, length, retval),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned char, report)
+		__field(unsigned int, length)
+		__field(int, retval)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->report = report;
+		__entry->length = length;
+		__entry->retval = retval;
+	),
+	TP_printk("minor=%d report=0x%02x length=%u retval=%d",
+		  __entry->minor, __entry->report, __entry->length,
+		  __entry->retval)
+);
+
+TRACE_EVENT(ambxlight_urb_complete,
+	TP_PROTO(int minor, unsigned char report, int status,
+		 unsigned int actual_length, s64 latency),
+	TP_ARGS(minor, report, status, actual_length, latency),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned char, report)
+		__field(int, status)
+		__field(unsigned int, actual_length)
+		__field(s64, latency)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->report = report;
+		__entry->status = status;
+		__entry->actual_length = actual_length;
+		__entry->latency = latency;
+	),
+	TP_printk("minor=%d report=0x%02x status=%d actual_length=%u latency=%lldus",
+		  __entry->minor, __entry->report, __entry->status,
+		  __entry->actual_length, __entry->latency)
+);
+
+TRACE_EVENT(ambxlight_params,
+	TP_PROTO(int minor, const unsigned char *params, unsigned int generation),
+	TP_ARGS(minor, params, generation),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__array(unsigned char, params, 9)
+		__field(unsigned int, generation)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		memcpy(__entry->params, params, 9);
+		__entry->generation = generation;
+	),
+	TP_printk("minor=%d params=%*ph generation=%u", __entry->minor,
+		  9, __entry->params, __entry->generation)
+);
+
+#endif
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ambxlight_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,279 @@
+/*
+ * End-to-end throughput and latency benchmark.
+ *
+ * Sends colors through libambxlight and ambxlight.ko to a pod, normally
+ * the one emulated by ambxlight-gadget on dummy_hcd:
+ *
+ *   ./ambxlight-gadget -o colors.log &
+ *   ./ambxlight-bench -m 0 -r colors.log
+ *
+ * or simply "make bench" as root. Each color carries its sequence number
+ * in its red, green and blue bytes. The send rate is measured here. With
+ * -r, the gadget's log of received reports is matched against the send
+ * times, which gives the rate at which colors reached the pod and the
+ * latency of each one from the call into the library to the SET_REPORT.
+ * Both sides read CLOCK_MONOTONIC on the same machine.
+ *
+ * -p sends to that many consecutive nodes at once, one thread each, and
+ * reports the combined rates. "make bench-cuse" uses it to measure how
+ * the library scales over the pods emulated by ambxlight-cuse.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libambxlight/libambxlight.h>
+
+#define SEQUENCE_MAX	0xffffff /* what fits in the three color bytes */
+
+struct bench_options {
+	int minor; /* N of /dev/ambx_lightN */
+	unsigned int pods; /* consecutive nodes to send to */
+	unsigned int colors; /* colors to send */
+	int coalesce; /* let the driver coalesce colors */
+	int stream; /* send over the interrupt endpoint */
+	const char *record; /* the gadget's color log, NULL if none */
+};
+
+/* one sending thread */
+struct bench_pod {
+	const struct bench_options *options;
+	libambxlight_device device;
+	long long *sent; /* send time of each color */
+	long long end; /* when the last color was submitted */
+	unsigned int failed;
+};
+
+static long long bench_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int compare_latency(const void *a, const void *b) {
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* wait until everything sent has reached the pod */
+static void bench_drain(libambxlight_device *device) {
+	int i;
+
+	/*
+	 * the parameter read is queued behind the colors on the control
+	 * pipe. the first read may only report the end of the last snapshot.
+	 */
+	for (i = 0; i < 2; i++) {
+		if (libambxlight_get_params(device) > 0) {
+			break;
+		}
+	}
+}
+
+/* match the gadget's log against the send times */
+static int bench_record(const struct bench_options *options, const long long *sent, long long start) {
+	FILE *log;
+	char line[128];
+	long long *latencies;
+	long long first = 0, last = 0, ts;
+	unsigned long sec, nsec;
+	unsigned int r, g, b, seq;
+	unsigned int received = 0;
+
+	log = fopen(options->record, "r");
+	if (!log) {
+		perror(options->record);
+		return -1;
+	}
+	latencies = calloc(options->colors, sizeof(*latencies));
+	if (!latencies) {
+		fclose(log);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), log)) {
+		if (sscanf(line, "%lu.%lu a2 00 %x %x %x", &sec, &nsec, &r, &g, &b) != 5) {
+			continue;
+		}
+		ts = sec * 1000000000LL + nsec;
+		seq = r << 16 | g << 8 | b;
+		/* colors from before this run, or not ours */
+		if (ts < start || seq == 0 || seq > options->colors || received == options->colors) {
+			continue;
+		}
+		if (!received) {
+			first = ts;
+		}
+		last = ts;
+		latencies[received++] = ts - sent[seq - 1];
+	}
+	fclose(log);
+
+	printf("received    %u of %u colors\n", received, options->colors);
+	if (received > 1) {
+		printf("delivered   %.0f colors/s\n", (received - 1) * 1e9 / (last - first));
+	}
+	if (received) {
+		qsort(latencies, received, sizeof(*latencies), compare_latency);
+		printf("latency     p50 %lld us  p99 %lld us  max %lld us\n",
+			latencies[received / 2] / 1000,
+			latencies[(received * 99ULL) / 100] / 1000,
+			latencies[received - 1] / 1000);
+	}
+
+	free(latencies);
+	return 0;
+}
+
+static void *bench_run(void *arg) {
+	struct bench_pod *pod = arg;
+	unsigned int seq;
+	int retval;
+
+	for (seq = 1; seq <= pod->options->colors; seq++) {
+		pod->sent[seq - 1] = bench_clock();
+		if (pod->options->stream) {
+			retval = libambxlight_stream_color_rgb(&pod->device, seq >> 16, seq >> 8, seq);
+		} else {
+			retval = libambxlight_change_color_rgb(pod->device, seq >> 16, seq >> 8, seq);
+		}
+		if (retval < 0) {
+			pod->failed++;
+		}
+	}
+	pod->end = bench_clock();
+	bench_drain(&pod->device);
+	return NULL;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s [-m minor] [-p pods] [-n colors] [-c] [-s] [-r log]\n"
+		"  -m minor   N of /dev/ambx_lightN (0)\n"
+		"  -p pods    send to this many nodes from minor on at once (1)\n"
+		"  -n colors  colors to send to each node (10000)\n"
+		"  -c         let the driver coalesce colors when its pool is full\n"
+		"  -s         stream colors over the interrupt endpoint\n"
+		"  -r log     color log written by ambxlight-gadget -o, one node only\n",
+		name);
+}
+
+int main(int argc, char **argv) {
+	struct bench_options options = {
+		.pods = 1,
+		.colors = 10000,
+	};
+	struct bench_pod *pods;
+	pthread_t *threads;
+	long long start, end = 0;
+	unsigned int failed = 0;
+	unsigned int opened, i;
+	int opt;
+	int retval = 1;
+
+	while ((opt = getopt(argc, argv, "m:p:n:csr:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			options.minor = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			options.pods = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			options.colors = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			options.coalesce = 1;
+			break;
+		case 's':
+			options.stream = 1;
+			break;
+		case 'r':
+			options.record = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!options.colors || options.colors > SEQUENCE_MAX) {
+		fprintf(stderr, "colors must be 1 to %u\n", SEQUENCE_MAX);
+		return 1;
+	}
+	if (!options.pods || (options.record && options.pods > 1)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	pods = calloc(options.pods, sizeof(*pods));
+	threads = calloc(options.pods, sizeof(*threads));
+	if (!pods || !threads) {
+		goto out;
+	}
+
+	for (opened = 0; opened < options.pods; opened++) {
+		struct bench_pod *pod = &pods[opened];
+
+		pod->options = &options;
+		pod->sent = calloc(options.colors, sizeof(*pod->sent));
+		if (!pod->sent) {
+			goto close;
+		}
+		pod->device.minor = options.minor + opened;
+		if (libambxlight_device_open(&pod->device) != 0) {
+			fprintf(stderr, "can't open /dev/ambx_light%d\n", pod->device.minor);
+			free(pod->sent);
+			goto close;
+		}
+		libambxlight_set_device_coalesce(&pod->device, options.coalesce);
+	}
+
+	start = bench_clock();
+	for (i = 0; i < options.pods; i++) {
+		if (pthread_create(&threads[i], NULL, bench_run, &pods[i]) != 0) {
+			/* finish the ones already running before giving up */
+			options.pods = i;
+			break;
+		}
+	}
+	for (i = 0; i < options.pods; i++) {
+		pthread_join(threads[i], NULL);
+		failed += pods[i].failed;
+		if (pods[i].end > end) {
+			end = pods[i].end;
+		}
+	}
+	if (i < opened) {
+		fprintf(stderr, "can't start the sending threads\n");
+		goto close;
+	}
+
+	printf("sent        %u colors to %u pods, %u failed\n", options.colors * options.pods, options.pods, failed);
+	printf("submitted   %.0f colors/s\n", (double)options.colors * options.pods * 1e9 / (end - start));
+	printf("drained     %.0f colors/s\n", (double)options.colors * options.pods * 1e9 / (bench_clock() - start));
+
+	retval = 0;
+	if (options.record) {
+		/* the gadget logs from its own thread, let it catch up */
+		usleep(100000);
+		retval = bench_record(&options, pods[0].sent, start) < 0;
+	}
+
+close:
+	while (opened--) {
+		libambxlight_device_close(pods[opened].device);
+		free(pods[opened].sent);
+	}
+out:
+	free(threads);
+	free(pods);
+	return retval;
+}
@@ -0,0 +1,348 @@
+/*
+ * Emulated /dev/ambx_lightN nodes.
+ *
+ * Implements the read/write/ioctl contract of ambxlight.ko in userspace
+ * through CUSE, so that libambxlight can be exercised without the module
+ * or a pod:
+ *
+ *   modprobe cuse
+ *   ./ambxlight-cuse -n 32 -b 100
+ *
+ * creates /dev/ambx_light100 to /dev/ambx_light131, each served by its own
+ * process. Writes in the RAW, COLOR, HEXSTRING and STREAM modes are
+ * decoded with the driver's own decoders, parameter commands are reflected
+ * in the 9 byte params read, and AMBXLIGHT_IOCTL_SET/GET/COALESCE behave as in
+ * the driver. The driver's other ioctls fail with ENOTTY and leave the
+ * mode alone, unknown ones also fall back to RAW mode as in the driver.
+ * The other write modes fail with EINVAL.
+ *
+ * -l delays every write the way slow completions delay the driver, and
+ * -e makes that percentage of O_NONBLOCK writes fail with EAGAIN as if
+ * the URB pool were exhausted. "make bench-cuse" runs ambxlight-bench
+ * over a growing number of these pods.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include "../driver/ambxlight_params.h"
+#include "../driver/ambxlight_ioctl.h"
+#include "../driver/ambxlight_decode.h"
+
+/* same limits as the driver */
+#define MAX_TRANSFER		64
+#define WRITES_IN_FLIGHT	8
+#define BATCH_TRANSFER		(WRITES_IN_FLIGHT * 16)
+
+struct emulator_options {
+	unsigned int count; /* pods to present */
+	unsigned int base; /* N of the first /dev/ambx_lightN */
+	unsigned int latency; /* usec added to each write */
+	unsigned int eagain; /* percent of nonblocking writes failing */
+};
+
+/* state of the pod served by this process */
+struct pod {
+	pthread_mutex_t lock;
+	unsigned char mode;
+	unsigned char coalesce;
+	union ambxlight_params params;
+	unsigned int seed; /* for rand_r() */
+};
+
+/* state of an open file */
+struct pod_file {
+	bool eof; /* params read out, report end of file once */
+};
+
+static struct emulator_options options = {
+	.count = 1,
+	.base = 0,
+};
+
+static struct pod pod = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.mode = AMBXLIGHT_MODE_HEXSTRING,
+	.params.param = {
+		.opcode = 0x0b,
+		.p3 = 0x01,
+		.location = LOCATION_C,
+		.center = 0x01,
+		.height = HEIGHT_ANY,
+		.intensity = 0xff,
+		.enabled = 0x01,
+	},
+};
+
+/* keep params in step with the commands received, pod.lock held */
+static void apply_report(const unsigned char *report, size_t len) {
+	switch (report[0]) {
+	case 0xa1: /* set device state */
+		pod.params.param.enabled = report[2];
+		break;
+	case 0xa4: /* set location */
+		pod.params.param.location = report[2];
+		pod.params.param.center = report[3];
+		break;
+	case 0xa5: /* set height */
+		pod.params.param.height = report[2];
+		break;
+	case 0xa6: /* set intensity */
+		pod.params.param.intensity = report[2];
+		break;
+	}
+}
+
+static void pod_open(fuse_req_t req, struct fuse_file_info *fi) {
+	struct pod_file *file = calloc(1, sizeof(*file));
+
+	if (!file) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uintptr_t)file;
+	fuse_reply_open(req, fi);
+}
+
+static void pod_release(fuse_req_t req, struct fuse_file_info *fi) {
+	free((struct pod_file *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void pod_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct pod_file *file = (struct pod_file *)(uintptr_t)fi->fh;
+	union ambxlight_params params;
+
+	if (file->eof) {
+		file->eof = false;
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&pod.lock);
+	params = pod.params;
+	pthread_mutex_unlock(&pod.lock);
+
+	file->eof = true;
+	fuse_reply_buf(req, (const char *)params.raw, size < sizeof(params.raw) ? size : sizeof(params.raw));
+}
+
+static void pod_write(fuse_req_t req, const char *user_buffer, size_t count, off_t off, struct fuse_file_info *fi) {
+	unsigned char buf[BATCH_TRANSFER];
+	size_t sizes[WRITES_IN_FLIGHT];
+	size_t writesize = count < sizeof(buf) ? count : sizeof(buf);
+	size_t retlen = writesize;
+	size_t offset;
+	int npackets = 0;
+	int retval;
+	int i;
+
+	if (count == 0) {
+		fuse_reply_write(req, 0);
+		return;
+	}
+
+	if ((fi->flags & O_NONBLOCK) && options.eagain &&
+	    (unsigned int)(rand_r(&pod.seed) % 100) < options.eagain) {
+		fuse_reply_err(req, EAGAIN);
+		return;
+	}
+
+	memcpy(buf, user_buffer, writesize);
+
+	pthread_mutex_lock(&pod.lock);
+	switch (pod.mode) {
+	default:
+		pod.mode = AMBXLIGHT_MODE_HEXSTRING;
+		/* fall through */
+	case AMBXLIGHT_MODE_HEXSTRING:
+		if (writesize != 6 && writesize != 7) {
+			retval = -EFAULT;
+			break;
+		}
+		retval = ambxlight_decode_hexstring(buf, buf);
+		if (retval) {
+			break;
+		}
+		writesize = 3;
+		/* fall through */
+	case AMBXLIGHT_MODE_COLOR:
+	case AMBXLIGHT_MODE_STREAM:
+		if (writesize != 3) {
+			retval = -EFAULT;
+			break;
+		}
+		ambxlight_pack_color(buf, buf[0], buf[1], buf[2], 0);
+		sizes[npackets++] = AMBXLIGHT_COLOR_REPORT;
+		retval = 0;
+		break;
+	case AMBXLIGHT_MODE_RAW:
+		retval = ambxlight_decode_raw(buf, writesize, sizes, WRITES_IN_FLIGHT, MAX_TRANSFER);
+		if (retval < 0) {
+			break;
+		}
+		npackets = retval;
+		retval = 0;
+		break;
+	case AMBXLIGHT_MODE_SCHEDULED:
+	case AMBXLIGHT_MODE_HEXSTREAM:
+		retval = -EINVAL;
+		break;
+	}
+	for (i = 0, offset = 0; !retval && i < npackets; offset += sizes[i++]) {
+		apply_report(&buf[offset], sizes[i]);
+	}
+	pthread_mutex_unlock(&pod.lock);
+
+	if (retval) {
+		fuse_reply_err(req, -retval);
+		return;
+	}
+
+	/* what a completion takes on a slow pod */
+	if (options.latency) {
+		usleep(options.latency);
+	}
+	fuse_reply_write(req, retlen);
+}
+
+static void pod_ioctl(fuse_req_t req, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+	unsigned char value;
+
+	pthread_mutex_lock(&pod.lock);
+	switch ((unsigned int)cmd) {
+	case AMBXLIGHT_IOCTL_SET:
+		pod.mode = *(const unsigned char *)in_buf;
+		pthread_mutex_unlock(&pod.lock);
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	case AMBXLIGHT_IOCTL_GET:
+		value = pod.mode;
+		pthread_mutex_unlock(&pod.lock);
+		fuse_reply_ioctl(req, 0, &value, sizeof(value));
+		return;
+	case AMBXLIGHT_IOCTL_COALESCE:
+		pod.coalesce = *(const unsigned char *)in_buf;
+		pthread_mutex_unlock(&pod.lock);
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	case AMBXLIGHT_IOCTL_KICK:
+	case AMBXLIGHT_IOCTL_POLL:
+	case AMBXLIGHT_IOCTL_EFFECT:
+	case AMBXLIGHT_IOCTL_LATENESS:
+	case AMBXLIGHT_IOCTL_TOLERANCE:
+	case AMBXLIGHT_IOCTL_RATE:
+	case AMBXLIGHT_IOCTL_STATE:
+	case AMBXLIGHT_IOCTL_GROUP:
+	case AMBXLIGHT_IOCTL_GROUP_FRAME:
+		/* the driver knows these, they just aren't emulated */
+		pthread_mutex_unlock(&pod.lock);
+		fuse_reply_err(req, ENOTTY);
+		return;
+	default:
+		/* as the driver does for ioctls it doesn't know */
+		pod.mode = AMBXLIGHT_MODE_RAW;
+		pthread_mutex_unlock(&pod.lock);
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+}
+
+static const struct cuse_lowlevel_ops pod_ops = {
+	.open = pod_open,
+	.release = pod_release,
+	.read = pod_read,
+	.write = pod_write,
+	.ioctl = pod_ioctl,
+};
+
+/* serve /dev/ambx_light<index> until the session ends */
+static int run_pod(unsigned int index, const char *progname) {
+	char devname[64];
+	const char *dev_info_argv[] = { devname };
+	char *argv[] = { (char *)progname, "-f", NULL };
+	struct cuse_info ci;
+
+	snprintf(devname, sizeof(devname), "DEVNAME=ambx_light%u", index);
+	pod.seed = index;
+
+	memset(&ci, 0, sizeof(ci));
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = dev_info_argv;
+
+	return cuse_lowlevel_main(2, argv, &ci, &pod_ops, NULL);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s [-n count] [-b base] [-l usec] [-e percent]\n"
+		"  -n count    pods to present (1)\n"
+		"  -b base     N of the first /dev/ambx_lightN (0)\n"
+		"  -l usec     delay each write by usec\n"
+		"  -e percent  fail this share of nonblocking writes with EAGAIN\n",
+		name);
+}
+
+int main(int argc, char **argv) {
+	unsigned int i;
+	int status;
+	int retval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:l:e:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			options.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			options.base = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			options.latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			options.eagain = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (options.count == 1) {
+		return run_pod(options.base, argv[0]);
+	}
+
+	/* one cuse session per process, one process per pod */
+	for (i = 0; i < options.count; i++) {
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			retval = 1;
+			break;
+		case 0:
+			return run_pod(options.base + i, argv[0]);
+		}
+	}
+
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			retval = 1;
+		}
+	}
+	return retval;
+}
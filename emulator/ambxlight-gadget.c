@@ -0,0 +1,535 @@
+/*
+ * Emulated Cyborg amBX Gaming Lights pod.
+ *
+ * Presents a 06a3:0dc5 device through the raw-gadget interface, so that
+ * ambxlight.ko and libambxlight can be driven without hardware, e.g. on
+ * dummy_hcd:
+ *
+ *   modprobe dummy_hcd
+ *   modprobe raw_gadget
+ *   ./ambxlight-gadget -o colors.log
+ *
+ * "make bench" does this and runs ambxlight-bench through ambxlight.ko
+ * against the emulated pod.
+ *
+ * The pod answers the 0x21/0x09 SET_REPORT commands and the 0xa1/0x01
+ * GET_REPORT parameter read. Every color report received can be logged,
+ * one line per report with a CLOCK_MONOTONIC timestamp, and latency or
+ * stalls can be injected into the SET_REPORT status stage.
+ *
+ * Only one interface is described, number 0. The pod ignores wIndex, and
+ * the usbfs transport claims whichever interface is described when there
+ * is no interface 3, so both the module and the usbfs transport can drive
+ * it. Its interrupt endpoint is an unused IN endpoint, unless -i
+ * describes it as the interrupt OUT endpoint that AMBXLIGHT_MODE_STREAM
+ * sends colors over. It is then enabled and the
+ * reports read from it are handled like SET_REPORTs, and -f halts it
+ * after that many reports to exercise the fallback to control transfers.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <asm/byteorder.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define AMBXLIGHT_VENDOR_ID	0x06a3
+#define AMBXLIGHT_PRODUCT_ID	0x0dc5
+
+#define EP0_MAX_DATA	256
+#define STREAM_MAX_PACKET	16
+
+#define STRING_ID_MANUFACTURER	1
+#define STRING_ID_PRODUCT	2
+
+struct ep0_request {
+	struct usb_raw_ep_io io;
+	unsigned char data[EP0_MAX_DATA];
+};
+
+struct stream_request {
+	struct usb_raw_ep_io io;
+	unsigned char data[STREAM_MAX_PACKET];
+};
+
+struct control_event {
+	struct usb_raw_event event;
+	struct usb_ctrlrequest ctrl;
+};
+
+/* endpoint descriptor without the audio fields, as sent on the wire */
+struct endpoint_descriptor {
+	__u8 bLength;
+	__u8 bDescriptorType;
+	__u8 bEndpointAddress;
+	__u8 bmAttributes;
+	__le16 wMaxPacketSize;
+	__u8 bInterval;
+} __attribute__((packed));
+
+struct gadget_options {
+	const char *driver_name;
+	const char *device_name;
+	FILE *log; /* color reports, NULL to not record them */
+	unsigned int latency; /* usec added to each SET_REPORT */
+	unsigned int stall_every; /* stall every nth SET_REPORT, 0 never */
+	unsigned int stream_interval; /* msec, 0 for no interrupt OUT endpoint */
+	unsigned long halt_after; /* halt the endpoint after n reports, 0 never */
+	int fd;
+	int stream_ep; /* handle of the enabled endpoint, -1 before */
+};
+
+/* the control and the stream thread both apply and log reports */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parameters as read back by GET_REPORT 0x0b, see ambxlight_params.h */
+static unsigned char params[9] = {
+	0x0b, /* opcode */
+	0x00,
+	0x00,
+	0x01,
+	0x00, /* location */
+	0x01, /* center */
+	0x00, /* height */
+	0xff, /* intensity */
+	0x01, /* enabled */
+};
+
+static const struct usb_device_descriptor device_descriptor = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = __constant_cpu_to_le16(0x0110),
+	.bDeviceClass = 0,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = __constant_cpu_to_le16(AMBXLIGHT_VENDOR_ID),
+	.idProduct = __constant_cpu_to_le16(AMBXLIGHT_PRODUCT_ID),
+	.bcdDevice = __constant_cpu_to_le16(0x0100),
+	.iManufacturer = STRING_ID_MANUFACTURER,
+	.iProduct = STRING_ID_PRODUCT,
+	.iSerialNumber = 0,
+	.bNumConfigurations = 1,
+};
+
+/* not const, -i turns the endpoint into the streaming one */
+static struct {
+	struct usb_config_descriptor config;
+	struct usb_interface_descriptor interface;
+	struct endpoint_descriptor endpoint;
+} __attribute__((packed)) config_descriptor = {
+	.config = {
+		.bLength = USB_DT_CONFIG_SIZE,
+		.bDescriptorType = USB_DT_CONFIG,
+		.wTotalLength = __constant_cpu_to_le16(sizeof(config_descriptor)),
+		.bNumInterfaces = 1,
+		.bConfigurationValue = 1,
+		.iConfiguration = 0,
+		.bmAttributes = USB_CONFIG_ATT_ONE,
+		.bMaxPower = 250, /* 500 mA */
+	},
+	/* vendor class, so that usbhid leaves the emulated pod to ambxlight */
+	.interface = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 1,
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+		.bInterfaceSubClass = 0,
+		.bInterfaceProtocol = 0,
+		.iInterface = 0,
+	},
+	.endpoint = {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = USB_DIR_IN | 1,
+		.bmAttributes = USB_ENDPOINT_XFER_INT,
+		.wMaxPacketSize = __constant_cpu_to_le16(8),
+		.bInterval = 10,
+	},
+};
+
+static const char *strings[] = {
+	[STRING_ID_MANUFACTURER] = "Cyborg",
+	[STRING_ID_PRODUCT] = "amBX Gaming Lights (emulated)",
+};
+
+/* build string descriptor index into data, returns its length */
+static int build_string(unsigned char index, unsigned char *data, size_t size) {
+	const char *string;
+	size_t len;
+	size_t i;
+
+	if (index == 0) {
+		/* supported languages, en-US only */
+		data[0] = 4;
+		data[1] = USB_DT_STRING;
+		data[2] = 0x09;
+		data[3] = 0x04;
+		return 4;
+	}
+	if (index >= sizeof(strings) / sizeof(strings[0]) || !strings[index]) {
+		return -1;
+	}
+
+	string = strings[index];
+	len = strlen(string);
+	if (2 + 2 * len > size) {
+		len = (size - 2) / 2;
+	}
+	data[0] = 2 + 2 * len;
+	data[1] = USB_DT_STRING;
+	for (i = 0; i < len; i++) {
+		data[2 + 2 * i] = string[i];
+		data[3 + 2 * i] = 0;
+	}
+	return data[0];
+}
+
+static void log_report(struct gadget_options *options, const unsigned char *report, size_t len) {
+	struct timespec now;
+	size_t i;
+
+	if (!options->log || len < 1 || report[0] != 0xa2) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(options->log, "%ld.%09ld", (long)now.tv_sec, now.tv_nsec);
+	for (i = 0; i < len; i++) {
+		fprintf(options->log, " %02x", report[i]);
+	}
+	fputc('\n', options->log);
+	fflush(options->log);
+}
+
+/* keep params in step with the commands received */
+static void apply_report(const unsigned char *report, size_t len) {
+	if (len < 3) {
+		return;
+	}
+
+	switch (report[0]) {
+	case 0xa1: /* set device state */
+		params[8] = report[2];
+		break;
+	case 0xa4: /* set location */
+		params[4] = report[2];
+		params[5] = len > 3 ? report[3] : !report[2];
+		break;
+	case 0xa5: /* set height */
+		params[6] = report[2];
+		break;
+	case 0xa6: /* set intensity */
+		params[7] = report[2];
+		break;
+	}
+}
+
+static int ep0_stall(int fd) {
+	if (ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP0_STALL)");
+		return -1;
+	}
+	return 0;
+}
+
+/* answer an IN request with len bytes of data, cut to what was asked for */
+static int ep0_reply(int fd, const struct usb_ctrlrequest *ctrl, struct ep0_request *request, size_t len) {
+	if (len > __le16_to_cpu(ctrl->wLength)) {
+		len = __le16_to_cpu(ctrl->wLength);
+	}
+	request->io.ep = 0;
+	request->io.flags = 0;
+	request->io.length = len;
+	if (ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, request) < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP0_WRITE)");
+		return -1;
+	}
+	return 0;
+}
+
+/* receive the data stage of an OUT request, or ack it if there is none */
+static int ep0_receive(int fd, const struct usb_ctrlrequest *ctrl, struct ep0_request *request) {
+	int retval;
+
+	request->io.ep = 0;
+	request->io.flags = 0;
+	request->io.length = __le16_to_cpu(ctrl->wLength);
+	if (request->io.length > sizeof(request->data)) {
+		request->io.length = sizeof(request->data);
+	}
+	retval = ioctl(fd, USB_RAW_IOCTL_EP0_READ, request);
+	if (retval < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP0_READ)");
+	}
+	return retval;
+}
+
+static void *stream_thread(void *arg) {
+	struct gadget_options *options = arg;
+	struct stream_request request;
+	unsigned long reports = 0;
+	int len;
+
+	for (;;) {
+		request.io.ep = options->stream_ep;
+		request.io.flags = 0;
+		request.io.length = sizeof(request.data);
+		len = ioctl(options->fd, USB_RAW_IOCTL_EP_READ, &request);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("ioctl(USB_RAW_IOCTL_EP_READ)");
+			return NULL;
+		}
+
+		pthread_mutex_lock(&report_lock);
+		apply_report(request.data, len);
+		log_report(options, request.data, len);
+		pthread_mutex_unlock(&report_lock);
+
+		if (options->halt_after && ++reports == options->halt_after) {
+			if (ioctl(options->fd, USB_RAW_IOCTL_EP_SET_HALT, options->stream_ep) < 0) {
+				perror("ioctl(USB_RAW_IOCTL_EP_SET_HALT)");
+			}
+			return NULL;
+		}
+	}
+}
+
+/* enable the streaming endpoint once configured, and start reading it */
+static int start_stream(struct gadget_options *options) {
+	struct usb_endpoint_descriptor endpoint;
+	pthread_t thread;
+
+	if (!options->stream_interval || options->stream_ep >= 0) {
+		return 0;
+	}
+
+	memset(&endpoint, 0, sizeof(endpoint));
+	memcpy(&endpoint, &config_descriptor.endpoint, sizeof(config_descriptor.endpoint));
+	options->stream_ep = ioctl(options->fd, USB_RAW_IOCTL_EP_ENABLE, &endpoint);
+	if (options->stream_ep < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_ENABLE)");
+		return -1;
+	}
+
+	if (pthread_create(&thread, NULL, stream_thread, options)) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+static int handle_standard(int fd, const struct usb_ctrlrequest *ctrl, struct ep0_request *request, struct gadget_options *options) {
+	unsigned char type = __le16_to_cpu(ctrl->wValue) >> 8;
+	unsigned char index = __le16_to_cpu(ctrl->wValue) & 0xff;
+	int len;
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (type) {
+		case USB_DT_DEVICE:
+			memcpy(request->data, &device_descriptor, sizeof(device_descriptor));
+			return ep0_reply(fd, ctrl, request, sizeof(device_descriptor));
+		case USB_DT_CONFIG:
+			memcpy(request->data, &config_descriptor, sizeof(config_descriptor));
+			return ep0_reply(fd, ctrl, request, sizeof(config_descriptor));
+		case USB_DT_STRING:
+			len = build_string(index, request->data, sizeof(request->data));
+			if (len < 0) {
+				return ep0_stall(fd);
+			}
+			return ep0_reply(fd, ctrl, request, len);
+		default:
+			/* no device qualifier, the pod is full speed only */
+			return ep0_stall(fd);
+		}
+	case USB_REQ_SET_CONFIGURATION:
+		if (ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, config_descriptor.config.bMaxPower) < 0) {
+			perror("ioctl(USB_RAW_IOCTL_VBUS_DRAW)");
+		}
+		if (start_stream(options) < 0) {
+			return -1;
+		}
+		if (ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+			perror("ioctl(USB_RAW_IOCTL_CONFIGURE)");
+			return -1;
+		}
+		return ep0_receive(fd, ctrl, request) < 0 ? -1 : 0;
+	case USB_REQ_SET_INTERFACE:
+		return ep0_receive(fd, ctrl, request) < 0 ? -1 : 0;
+	case USB_REQ_GET_INTERFACE:
+		request->data[0] = 0;
+		return ep0_reply(fd, ctrl, request, 1);
+	case USB_REQ_GET_STATUS:
+		request->data[0] = 0;
+		request->data[1] = 0;
+		return ep0_reply(fd, ctrl, request, 2);
+	default:
+		return ep0_stall(fd);
+	}
+}
+
+static int handle_class(int fd, const struct usb_ctrlrequest *ctrl, struct ep0_request *request, struct gadget_options *options) {
+	static unsigned long set_reports;
+	int len;
+
+	/* GET_REPORT, the parameter read */
+	if (ctrl->bRequestType == 0xa1 && ctrl->bRequest == 0x01) {
+		if (__le16_to_cpu(ctrl->wValue) != 0x0b) {
+			return ep0_stall(fd);
+		}
+		memcpy(request->data, params, sizeof(params));
+		return ep0_reply(fd, ctrl, request, sizeof(params));
+	}
+
+	/* SET_REPORT, every command the driver sends */
+	if (ctrl->bRequestType == 0x21 && ctrl->bRequest == 0x09) {
+		set_reports++;
+		if (options->stall_every && set_reports % options->stall_every == 0) {
+			return ep0_stall(fd);
+		}
+		if (options->latency) {
+			usleep(options->latency);
+		}
+		len = ep0_receive(fd, ctrl, request);
+		if (len < 0) {
+			return -1;
+		}
+		pthread_mutex_lock(&report_lock);
+		apply_report(request->data, len);
+		log_report(options, request->data, len);
+		pthread_mutex_unlock(&report_lock);
+		return 0;
+	}
+
+	return ep0_stall(fd);
+}
+
+static int run(int fd, struct gadget_options *options) {
+	struct control_event event;
+	struct ep0_request request;
+
+	for (;;) {
+		event.event.type = 0;
+		event.event.length = sizeof(event.ctrl);
+		if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("ioctl(USB_RAW_IOCTL_EVENT_FETCH)");
+			return -1;
+		}
+
+		if (event.event.type != USB_RAW_EVENT_CONTROL) {
+			continue;
+		}
+
+		if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD) {
+			handle_standard(fd, &event.ctrl, &request, options);
+		} else if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
+			handle_class(fd, &event.ctrl, &request, options);
+		} else {
+			ep0_stall(fd);
+		}
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s [-d driver] [-D device] [-o log] [-l usec] [-s n] [-i msec [-f n]]\n"
+		"  -d driver  UDC driver name (dummy_udc)\n"
+		"  -D device  UDC device name (dummy_udc.0)\n"
+		"  -o log     record color reports to log, - for stdout\n"
+		"  -l usec    delay each SET_REPORT by usec\n"
+		"  -s n       stall every nth SET_REPORT\n"
+		"  -i msec    stream colors over an interrupt OUT endpoint of that interval\n"
+		"  -f n       halt the interrupt OUT endpoint after n reports\n",
+		name);
+}
+
+int main(int argc, char **argv) {
+	struct gadget_options options = {
+		.driver_name = "dummy_udc",
+		.device_name = "dummy_udc.0",
+		.stream_ep = -1,
+	};
+	struct usb_raw_init init;
+	int opt;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "d:D:o:l:s:i:f:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			options.driver_name = optarg;
+			break;
+		case 'D':
+			options.device_name = optarg;
+			break;
+		case 'o':
+			options.log = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+			if (!options.log) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			options.latency = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			options.stall_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			options.stream_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			options.halt_after = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (options.stream_interval) {
+		config_descriptor.endpoint.bEndpointAddress = USB_DIR_OUT | 1;
+		config_descriptor.endpoint.wMaxPacketSize = __cpu_to_le16(STREAM_MAX_PACKET);
+		config_descriptor.endpoint.bInterval = options.stream_interval;
+	}
+
+	fd = open("/dev/raw-gadget", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/raw-gadget");
+		return 1;
+	}
+	options.fd = fd;
+
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, options.driver_name, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, options.device_name, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_FULL;
+	if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0) {
+		perror("ioctl(USB_RAW_IOCTL_INIT)");
+		return 1;
+	}
+	if (ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("ioctl(USB_RAW_IOCTL_RUN)");
+		return 1;
+	}
+
+	return run(fd, &options) < 0 ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Library scaling benchmark: libambxlight against the nodes emulated by
+# ambxlight-cuse, without the module or a pod. Needs root for CUSE.
+#
+#   PODS     most pods to send to at once, doubled from 1 (16)
+#   BASE     N of the first emulated /dev/ambx_lightN (100)
+#   COLORS   colors to send to each pod (10000)
+#   LATENCY  usec each emulated write takes (0)
+#   EAGAIN   percent of nonblocking writes failing with EAGAIN (0)
+#   BENCH    extra ambxlight-bench options, e.g. -c
+
+set -e
+
+cd "$(dirname "$0")"
+PODS=${PODS:-16}
+BASE=${BASE:-100}
+
+modprobe cuse
+
+./ambxlight-cuse -n "$PODS" -b "$BASE" -l "${LATENCY:-0}" -e "${EAGAIN:-0}" &
+CUSE_PID=$!
+trap 'pkill -P $CUSE_PID 2>/dev/null; kill $CUSE_PID 2>/dev/null' EXIT
+
+last=/dev/ambx_light$((BASE + PODS - 1))
+for i in $(seq 50); do
+	[ -e "$last" ] && break
+	sleep 0.1
+done
+if [ ! -e "$last" ]; then
+	echo "the emulated pods didn't show up" >&2
+	exit 1
+fi
+
+pods=1
+while [ "$pods" -le "$PODS" ]; do
+	echo "== $pods pods"
+	./ambxlight-bench -m "$BASE" -p "$pods" -n "${COLORS:-10000}" $BENCH
+	pods=$((pods * 2))
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# End-to-end benchmark: ambxlight.ko and libambxlight against the pod
+# emulated by ambxlight-gadget on dummy_hcd. Needs root.
+#
+#   COLORS   colors to send (10000)
+#   LATENCY  usec the pod takes for each SET_REPORT (0)
+#   BENCH    extra ambxlight-bench options, e.g. -c or -s
+#   GADGET   extra ambxlight-gadget options, e.g. -i 1 for -s
+
+set -e
+
+cd "$(dirname "$0")"
+LOG=$(mktemp /tmp/ambxlight-bench.XXXXXX)
+
+modprobe dummy_hcd
+modprobe raw_gadget
+if ! grep -q '^ambxlight ' /proc/modules; then
+	insmod ../driver/ambxlight.ko
+fi
+
+before=$(ls /dev/ambx_light* 2>/dev/null || true)
+./ambxlight-gadget -o "$LOG" -l "${LATENCY:-0}" $GADGET &
+GADGET_PID=$!
+trap 'kill $GADGET_PID 2>/dev/null; rm -f "$LOG"' EXIT
+
+# the pod is the node that wasn't there before
+node=
+for i in $(seq 50); do
+	for n in /dev/ambx_light*; do
+		[ -e "$n" ] || continue
+		echo "$before" | grep -qx "$n" || node=$n
+	done
+	[ -n "$node" ] && break
+	sleep 0.1
+done
+if [ -z "$node" ]; then
+	echo "the emulated pod didn't show up" >&2
+	exit 1
+fi
+
+./ambxlight-bench -m "${node#/dev/ambx_light}" -n "${COLORS:-10000}" -r "$LOG" $BENCH
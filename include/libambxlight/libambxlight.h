@@ -31,12 +31,170 @@ union libambxlight_device_params {
 	} param;
 };
 
+struct libambxlight_transport;
+struct libambxlight_suppression;
+
 /* amBX device structure */
 struct libambxlight_device {
 	int fd; /* file discriptor */
 	int minor; /* device minor */
 	union libambxlight_device_params params; /* device parameters */
 	unsigned char mode; /* ioctl mode */
+	const struct libambxlight_transport *transport; /* how reports reach the device */
+	void *transport_data; /* private to the transport */
+	struct libambxlight_suppression *suppression; /* redundant color suppression, NULL when off */
+};
+
+/*
+ * Transport, moves reports between the library and a device. The kernel
+ * transport goes through the ambxlight module, the usbfs transport talks
+ * to the pod directly and needs the module not to be bound to it. Only
+ * reports and the parameter read go through the transport, the ioctl
+ * based features need the kernel transport.
+ */
+struct libambxlight_transport {
+	const char *name;
+	int (*open)(struct libambxlight_device *device); /* 0 on success */
+	void (*close)(struct libambxlight_device *device);
+	/* send reports laid out back to back as in RAW mode, returns the bytes taken */
+	ssize_t (*write)(struct libambxlight_device *device, const unsigned char *data, size_t len);
+	/* read the parameters into device->params, returns the bytes read */
+	int (*read_params)(struct libambxlight_device *device);
+};
+
+/* Shared color register, mapped from the device node */
+struct libambxlight_shared {
+	unsigned int sequence; /* odd while an update is in progress */
+	unsigned int generation; /* bumped for each new color */
+	unsigned char red;
+	unsigned char green;
+	unsigned char blue;
+	unsigned char reserved;
+	unsigned short fade; /* msec */
+	unsigned short reserved2;
+};
+
+/* Effect keyframe, the device fades to the color and holds it */
+struct libambxlight_keyframe {
+	unsigned char red;
+	unsigned char green;
+	unsigned char blue;
+	unsigned char reserved;
+	unsigned short fade; /* msec */
+	unsigned short hold; /* msec */
+};
+
+#define LIBAMBXLIGHT_EFFECT_MAX_FRAMES 64
+
+/* Point of a color curve for the fade planner, colors in between are interpolated */
+struct libambxlight_curve_point {
+	unsigned int time; /* msec from the start of the curve */
+	unsigned char red;
+	unsigned char green;
+	unsigned char blue;
+	unsigned char reserved;
+};
+
+/* Effect program played by the driver */
+struct libambxlight_effect {
+	unsigned int flags;
+	unsigned int count; /* 0 stops the running effect */
+	struct libambxlight_keyframe frames[LIBAMBXLIGHT_EFFECT_MAX_FRAMES];
+};
+
+/* Effect flags */
+enum libambxlight_effect_flags {
+	EFFECT_LOOP = 0x01,
+};
+
+#define LIBAMBXLIGHT_SCHEDULE_DEPTH 64
+
+/* Color report sent by the driver once the monotonic clock reaches timestamp */
+struct libambxlight_scheduled {
+	long long timestamp; /* nsec, CLOCK_MONOTONIC */
+	unsigned char report[9];
+	unsigned char reserved[7];
+};
+
+/* What became of a scheduled color */
+struct libambxlight_lateness {
+	long long timestamp; /* nsec, the deadline of the entry */
+	long long lateness; /* nsec between the deadline and the submission */
+	int status; /* 0 if sent, -ETIME if dropped, else submit error */
+	unsigned int reserved;
+};
+
+/* Full device state, only the fields in mask are applied */
+struct libambxlight_state {
+	unsigned int mask; /* libambxlight_state_fields */
+	unsigned char red;
+	unsigned char green;
+	unsigned char blue;
+	unsigned char enabled;
+	unsigned short fade; /* msec */
+	unsigned char location;
+	unsigned char height;
+	unsigned char intensity;
+	unsigned char reserved[3];
+};
+
+/* State fields */
+enum libambxlight_state_fields {
+	STATE_COLOR = 0x01,
+	STATE_ENABLED = 0x02,
+	STATE_LOCATION = 0x04,
+	STATE_HEIGHT = 0x08,
+	STATE_INTENSITY = 0x10,
+};
+
+#define LIBAMBXLIGHT_GROUP_MAX 8
+
+/* Sync group, the minors of its devices, N of /dev/ambx_lightN as in libambxlight_device */
+struct libambxlight_group {
+	unsigned int count;
+	int minors[LIBAMBXLIGHT_GROUP_MAX];
+};
+
+/* Group frame, one color per device in group order, hold is ignored */
+struct libambxlight_group_frame {
+	unsigned int count;
+	unsigned int reserved;
+	struct libambxlight_keyframe colors[LIBAMBXLIGHT_GROUP_MAX];
+};
+
+/* Colors sent and suppressed as redundant by libambxlight_change_color_rgb*() */
+struct libambxlight_suppression_stats {
+	unsigned long long sent;
+	unsigned long long suppressed;
+};
+
+/* Completion of a write queued on an io_uring engine */
+struct libambxlight_uring_completion {
+	struct libambxlight_device *device;
+	int result; /* bytes written, less than expected if short, or -errno */
+	unsigned int expected; /* bytes queued */
+};
+
+#define LIBAMBXLIGHT_FRAME_MAX 64
+
+/* One device of a frame */
+struct libambxlight_frame_pod {
+	struct libambxlight_device *device;
+	unsigned char report[9]; /* last color report set, 0xa2 once set */
+	unsigned char set; /* set since libambxlight_frame_begin() */
+	unsigned char reserved[2];
+	int result; /* of the last commit, 0 if sent, 1 if left out, -1 if it failed */
+};
+
+/* Colors for several devices, sent together by libambxlight_frame_commit() */
+struct libambxlight_frame {
+	unsigned int count;
+	int grouped; /* the devices form a sync group led by the first one */
+	long long commit_start; /* nsec, CLOCK_MONOTONIC when the last commit started */
+	long long commit_duration; /* nsec it took */
+	unsigned int syscalls; /* syscalls it made */
+	unsigned int reserved;
+	struct libambxlight_frame_pod pods[LIBAMBXLIGHT_FRAME_MAX];
 };
 
 /* Location parameter values */
@@ -68,16 +226,48 @@ enum libambxlight_device_height {
 #define AMBXLIGHT_IOCTL_QUERY  _IOC( _IOC_NONE,  AMBXLIGHT_IOCTL_MAGIC, 0x02, 0)
 #define AMBXLIGHT_IOCTL_GET    _IOC( _IOC_READ,  AMBXLIGHT_IOCTL_MAGIC, 0x03, sizeof(char))
 #define AMBXLIGHT_IOCTL_RESET  _IOC( _IOC_NONE,  AMBXLIGHT_IOCTL_MAGIC, 0x04, 0)
+#define AMBXLIGHT_IOCTL_COALESCE  _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x05, sizeof(char))
+#define AMBXLIGHT_IOCTL_KICK   _IOC( _IOC_NONE,  AMBXLIGHT_IOCTL_MAGIC, 0x06, 0)
+#define AMBXLIGHT_IOCTL_POLL   _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x07, sizeof(unsigned int))
+#define AMBXLIGHT_IOCTL_EFFECT _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x08, sizeof(struct libambxlight_effect))
+#define AMBXLIGHT_IOCTL_LATENESS  _IOC( _IOC_READ,  AMBXLIGHT_IOCTL_MAGIC, 0x09, sizeof(struct libambxlight_lateness))
+#define AMBXLIGHT_IOCTL_TOLERANCE _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0a, sizeof(unsigned int))
+#define AMBXLIGHT_IOCTL_RATE   _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0b, sizeof(unsigned int))
+#define AMBXLIGHT_IOCTL_STATE  _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0c, sizeof(struct libambxlight_state))
+#define AMBXLIGHT_IOCTL_GROUP  _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0d, sizeof(struct libambxlight_group))
+#define AMBXLIGHT_IOCTL_GROUP_FRAME _IOC( _IOC_WRITE, AMBXLIGHT_IOCTL_MAGIC, 0x0e, sizeof(struct libambxlight_group_frame))
 
 /* Define transfer mode */
 enum libambxlight_device_write_mode {
 	RAW = 0x01,
 	COLOR = 0x02,
 	HEXSTRING = 0x04,
+	SCHEDULED = 0x08,
+	HEXSTREAM = 0x10,
+	STREAM = 0x20,
 };
 
 typedef struct libambxlight_version libambxlight_version;
 typedef struct libambxlight_device libambxlight_device;
+typedef struct libambxlight_transport libambxlight_transport;
+typedef struct libambxlight_shared libambxlight_shared;
+typedef struct libambxlight_keyframe libambxlight_keyframe;
+typedef struct libambxlight_curve_point libambxlight_curve_point;
+typedef struct libambxlight_scheduled libambxlight_scheduled;
+typedef struct libambxlight_lateness libambxlight_lateness;
+typedef struct libambxlight_state libambxlight_state;
+typedef struct libambxlight_registry libambxlight_registry;
+typedef struct libambxlight_frame libambxlight_frame;
+typedef struct libambxlight_uring libambxlight_uring;
+typedef struct libambxlight_uring_completion libambxlight_uring_completion;
+typedef struct libambxlight_async libambxlight_async;
+typedef struct libambxlight_suppression_stats libambxlight_suppression_stats;
+
+/* called when a pod comes (present 1) or goes (present 0) */
+typedef void (*libambxlight_hotplug_callback)(int minor, int present, void *arg);
+
+/* color of a curve msec after its start */
+typedef void (*libambxlight_curve_callback)(unsigned int msec, unsigned char *r, unsigned char *g, unsigned char *b, void *arg);
 
 
 /* libambxlight */
@@ -87,18 +277,104 @@ const struct libambxlight_version libambxlight_get_version();
 ssize_t libambxlight_get_device_list(libambxlight_device ***list);
 void libambxlight_free_device_list(libambxlight_device **list);
 
+/*
+ * Registry of the pods bound to the module, kept up to date by
+ * libambxlight_registry_process() once its fd polls readable. A handle
+ * from libambxlight_registry_device() stays open until its pod goes away
+ * or the registry is closed.
+ */
+libambxlight_registry *libambxlight_registry_open(void);
+void libambxlight_registry_close(libambxlight_registry *registry);
+void libambxlight_registry_set_callback(libambxlight_registry *registry, libambxlight_hotplug_callback callback, void *arg);
+int libambxlight_registry_fd(libambxlight_registry *registry);
+int libambxlight_registry_process(libambxlight_registry *registry);
+ssize_t libambxlight_registry_minors(libambxlight_registry *registry, int *minors, size_t max);
+libambxlight_device *libambxlight_registry_device(libambxlight_registry *registry, int minor);
+
+extern const struct libambxlight_transport libambxlight_kernel_transport;
+extern const struct libambxlight_transport libambxlight_usbfs_transport;
+
 int libambxlight_device_open(libambxlight_device *device);
+int libambxlight_device_open_with_transport(libambxlight_device *device, const libambxlight_transport *transport);
 void libambxlight_device_close(libambxlight_device device);
 
 void libambxlight_set_device_write_mode(libambxlight_device *device, enum libambxlight_device_write_mode mode);
 enum libambxlight_device_write_mode libambxlight_get_device_write_mode(libambxlight_device *device);
-void libambxlight_change_color_rgb(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b);
-void libambxlight_change_color_rgb_with_fade(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
-void libambxlight_set_device_state(libambxlight_device *device, unsigned char state);
-void libambxlight_set_device_intensity(libambxlight_device *device, unsigned char intensity);
-void libambxlight_set_device_height(libambxlight_device *device, unsigned char height);
-void libambxlight_set_device_location(libambxlight_device *device, unsigned char location);
+void libambxlight_set_device_coalesce(libambxlight_device *device, unsigned char enabled);
+int libambxlight_change_color_rgb(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b);
+int libambxlight_change_color_rgb_with_fade(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
+int libambxlight_stream_color_rgb(libambxlight_device *device, unsigned char r, unsigned char g, unsigned char b);
+int libambxlight_set_color_suppression(libambxlight_device *device, unsigned int threshold, unsigned int max_age);
+void libambxlight_get_suppression_stats(libambxlight_device *device, libambxlight_suppression_stats *stats);
+int libambxlight_set_device_state(libambxlight_device *device, unsigned char state);
+int libambxlight_set_device_intensity(libambxlight_device *device, unsigned char intensity);
+int libambxlight_set_device_height(libambxlight_device *device, unsigned char height);
+int libambxlight_set_device_location(libambxlight_device *device, unsigned char location);
 int libambxlight_get_params(libambxlight_device *device);
+int libambxlight_apply_device_state(libambxlight_device *device, const libambxlight_state *state);
+
+libambxlight_shared *libambxlight_map_shared_register(libambxlight_device *device);
+void libambxlight_unmap_shared_register(libambxlight_shared *shared);
+void libambxlight_shared_change_color_rgb_with_fade(libambxlight_shared *shared, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
+int libambxlight_kick_device(libambxlight_device *device);
+void libambxlight_set_device_poll_interval(libambxlight_device *device, unsigned int msec);
+
+int libambxlight_play_effect(libambxlight_device *device, const libambxlight_keyframe *frames, unsigned int count, unsigned int flags);
+int libambxlight_stop_effect(libambxlight_device *device);
+
+/*
+ * Fade planner, turns a color curve into the fewest hardware faded
+ * keyframes staying within max_error of it on every channel. The
+ * keyframes can be played with libambxlight_play_effect() or sent one by
+ * one with libambxlight_change_color_rgb_with_fade().
+ */
+ssize_t libambxlight_plan_fade(const libambxlight_curve_point *points, unsigned int count, unsigned int max_error, libambxlight_keyframe *frames, unsigned int max);
+ssize_t libambxlight_plan_fade_callback(libambxlight_curve_callback callback, void *arg, unsigned int duration, unsigned int step, unsigned int max_error, libambxlight_keyframe *frames, unsigned int max);
+
+void libambxlight_scheduled_color_rgb_with_fade(libambxlight_scheduled *entry, long long timestamp, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
+ssize_t libambxlight_schedule_colors(libambxlight_device *device, const libambxlight_scheduled *entries, unsigned int count);
+int libambxlight_get_lateness(libambxlight_device *device, libambxlight_lateness *report);
+void libambxlight_set_schedule_tolerance(libambxlight_device *device, unsigned int usec);
+void libambxlight_set_hexstream_rate(libambxlight_device *device, unsigned int colors_per_second);
+
+int libambxlight_set_device_group(libambxlight_device *device, const int *minors, unsigned int count);
+int libambxlight_push_group_frame(libambxlight_device *device, const libambxlight_keyframe *colors, unsigned int count);
+
+/*
+ * Frames, one color per device pushed with a single commit. A frame
+ * starts zeroed, and its devices must be in RAW mode, as
+ * libambxlight_device_open() leaves them.
+ */
+int libambxlight_frame_begin(libambxlight_frame *frame, libambxlight_device **devices, unsigned int count);
+int libambxlight_frame_set(libambxlight_frame *frame, unsigned int index, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
+int libambxlight_frame_commit(libambxlight_frame *frame);
+int libambxlight_frame_commit_uring(libambxlight_frame *frame, libambxlight_uring *ring);
+
+/*
+ * io_uring engine, writes to any number of devices queued and submitted
+ * with one syscall. Writes to one device are carried out in the order they
+ * were queued. libambxlight_uring_open() returns NULL where io_uring is not
+ * available.
+ */
+libambxlight_uring *libambxlight_uring_open(unsigned int entries);
+void libambxlight_uring_close(libambxlight_uring *ring);
+int libambxlight_uring_fd(libambxlight_uring *ring);
+int libambxlight_uring_queue_write(libambxlight_uring *ring, libambxlight_device *device, const unsigned char *data, size_t len);
+int libambxlight_uring_queue_color(libambxlight_uring *ring, libambxlight_device *device, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
+int libambxlight_uring_submit(libambxlight_uring *ring);
+int libambxlight_uring_reap(libambxlight_uring *ring, libambxlight_uring_completion *completions, unsigned int max, int wait);
+
+/*
+ * Thread-safe handle, any thread may publish colors and state without
+ * waiting for the device, a writer thread sends the newest of them. The
+ * device must be open and in RAW mode, and is only written by the writer
+ * until the handle is closed.
+ */
+libambxlight_async *libambxlight_async_open(libambxlight_device *device);
+void libambxlight_async_close(libambxlight_async *async);
+void libambxlight_async_set_color(libambxlight_async *async, unsigned char r, unsigned char g, unsigned char b, unsigned int msec);
+void libambxlight_async_set_state(libambxlight_async *async, const libambxlight_state *state);
+int libambxlight_async_error(libambxlight_async *async);
 
 #ifdef __cplusplus
 };
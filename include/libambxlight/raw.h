@@ -0,0 +1,68 @@
+#ifndef _LIBAMBXLIGHT_RAW_H__
+#define _LIBAMBXLIGHT_RAW_H__
+
+/*
+ * Framing of the reports in a RAW mode write. The module and the usbfs
+ * transport both split writes with this, so that a write means the same
+ * whichever way it reaches the pod.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#else
+#include <stddef.h>
+#include <errno.h>
+#endif
+
+/* size of a 0xa2 color report */
+#define AMBXLIGHT_COLOR_REPORT	9
+
+/*
+ * size of the framed report at the start of a RAW write of len bytes, or
+ * -EFAULT if it isn't one the device knows or is longer than max
+ */
+static inline int ambxlight_raw_packet_size(const unsigned char *buf,
+					    size_t len, size_t max)
+{
+	size_t size;
+
+	/*
+	 * urb data packet format
+	 *
+	 * |  00  |  01  |  02  | 03.. |
+	 * |OPCODE| 0x00 |  values...  |
+	 *
+	 */
+	if (len < 2 || buf[1] != 0x00)
+		return -EFAULT;
+
+	switch (buf[0]) {
+		case 0xa1: /* set device state */
+		case 0xa5: /* set height */
+		case 0xa6: /* set intensity */
+			size = 3;
+			break;
+		case 0xa2: /* chenge light color */
+			size = AMBXLIGHT_COLOR_REPORT;
+			break;
+		case 0xa3:
+			/* unknown, takes the rest of the write */
+			size = len;
+			break;
+		case 0xa4: /* set location */
+			size = 4;
+			break;
+		case 0xa7: /* prepare read parameters */
+			size = 2;
+			break;
+		default:
+			return -EFAULT;
+	}
+
+	if (size > len || size > max)
+		return -EFAULT;
+	return size;
+}
+
+#endif
@@ -1,5 +1,5 @@
 #ifndef LIBAMBXLIGHT_MAJOR
-#define LIBAMBXLIGHT_MAJOR 3
+#define LIBAMBXLIGHT_MAJOR 4
 #endif
 #ifndef LIBAMBXLIGHT_MINOR
 #define LIBAMBXLIGHT_MINOR 0
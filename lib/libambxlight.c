@@ -3,7 +3,12 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
 
 #include <libambxlight/libambxlight.h>
 #include <libambxlight/version.h>
@@ -18,40 +23,9 @@ const struct libambxlight_version libambxlight_get_version() {
 	return version;
 }
 
-ssize_t libambxlight_get_device_list(libambxlight_device ***list) {
-	unsigned int i;
-	unsigned int size = 0;
-	const unsigned int max_size = 128;
-	unsigned int fds[max_size];
-
-	for (i = 0; i < max_size; i++) {
-		libambxlight_device tmp_device = {
-			.minor = i
-		};
-		int retval = libambxlight_device_open(&tmp_device);
-		if (retval == 0) {
-			libambxlight_device_close(tmp_device);
-			fds[size] = i;
-			size++;
-		}
-	}
-
-	*list = (libambxlight_device **)malloc(sizeof(libambxlight_device *));
-	for (i = 0; i < size; i++) {
-		*list[i] = (libambxlight_device *)malloc(sizeof(libambxlight_device));
-		(*list[i])->minor = fds[i];
-	}
-
-	return size;
-}
-
-void libambxlight_free_device_list(libambxlight_device **list) {
-	free(list);
-}
-
-int libambxlight_device_open(libambxlight_device *device) {
+/* kernel transport, reports go through the ambxlight module */
+static int kernel_open(libambxlight_device *device) {
 	char name[20];
-	int retval;
 	struct stat file_stat;
 
 	sprintf(name, "/dev/ambx_light%d", device->minor);
@@ -79,11 +53,57 @@ int libambxlight_device_open(libambxlight_device *device) {
 	return 0;
 }
 
+static void kernel_close(libambxlight_device *device) {
+	device->mode = (enum libambxlight_device_write_mode)HEXSTRING & 0xf;
+	ioctl(device->fd, AMBXLIGHT_IOCTL_SET, &device->mode);
+	close(device->fd);
+	device->fd = -1;
+}
+
+static ssize_t kernel_write(libambxlight_device *device, const unsigned char *data, size_t len) {
+	return write(device->fd, data, len);
+}
+
+static int kernel_read_params(libambxlight_device *device) {
+	return read(device->fd, &device->params, sizeof(device->params));
+}
+
+const struct libambxlight_transport libambxlight_kernel_transport = {
+	.name = "kernel",
+	.open = kernel_open,
+	.close = kernel_close,
+	.write = kernel_write,
+	.read_params = kernel_read_params,
+};
+
+static const struct libambxlight_transport *device_transport(libambxlight_device *device) {
+	return device->transport ? device->transport : &libambxlight_kernel_transport;
+}
+
+/* send reports laid out back to back, as in RAW mode */
+static ssize_t device_write(libambxlight_device *device, const unsigned char *data, size_t len) {
+	return device_transport(device)->write(device, data, len);
+}
+
+/* 0 if all of data went out, -1 on errors and short writes */
+static int device_write_all(libambxlight_device *device, const unsigned char *data, size_t len) {
+	return device_write(device, data, len) == (ssize_t)len ? 0 : -1;
+}
+
+int libambxlight_device_open(libambxlight_device *device) {
+	return libambxlight_device_open_with_transport(device, &libambxlight_kernel_transport);
+}
+
+int libambxlight_device_open_with_transport(libambxlight_device *device, const libambxlight_transport *transport) {
+	device->transport = transport;
+	device->transport_data = NULL;
+	device->suppression = NULL;
+	return transport->open(device);
+}
+
 void libambxlight_device_close(libambxlight_device device) {
-	device.mode = (enum libambxlight_device_write_mode)HEXSTRING & 0xf;
-	ioctl(device.fd, AMBXLIGHT_IOCTL_SET, &device.mode);
-	close(device.fd);
-	device.fd = -1;
+	device_transport(&device)->close(&device);
+	free(device.suppression);
 }
 
 void libambxlight_set_device_write_mode(libambxlight_device *device, enum libambxlight_device_write_mode mode) {
@@ -96,7 +116,153 @@ enum libambxlight_device_write_mode libambxlight_get_device_write_mode(libambxli
 	return (enum libambxlight_device_write_mode)device->mode;
 }
 
-void libambxlight_change_color_rgb(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b) {
+void libambxlight_set_device_coalesce(libambxlight_device *device, unsigned char enabled) {
+	ioctl(device->fd, AMBXLIGHT_IOCTL_COALESCE, &enabled);
+}
+
+/*
+ * Redundant color suppression. The CIELAB coordinates of the last color
+ * sent are kept, and a color closer to it than the threshold (CIE76 delta
+ * E) is not sent unless the last one is older than max_age. The
+ * conversion uses tables in 12 bit fixed point, built once.
+ */
+static long long frame_clock(void);
+
+#define LAB_SHIFT 12
+#define LAB_ONE (1 << LAB_SHIFT)
+#define LAB_F_SIZE (LAB_ONE + LAB_ONE / 8) /* X/Xn and Z/Zn go a little over 1 */
+
+struct libambxlight_suppression {
+	unsigned int threshold; /* hundredths of delta E */
+	unsigned int max_age; /* msec, 0 for no forced refresh */
+	int known; /* lab holds the last color sent */
+	int lab[3]; /* L, a, b of it, LAB_SHIFT fixed point */
+	long long sent_at; /* nsec, CLOCK_MONOTONIC */
+	struct libambxlight_suppression_stats stats;
+};
+
+static int lab_linear[256]; /* sRGB component to linear light */
+static int lab_f[LAB_F_SIZE]; /* the CIELAB f() */
+static pthread_once_t lab_once = PTHREAD_ONCE_INIT;
+
+static void lab_init(void) {
+	double c, t;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		c = i / 255.0;
+		c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		lab_linear[i] = lround(c * LAB_ONE);
+	}
+	for (i = 0; i < LAB_F_SIZE; i++) {
+		t = (double)i / LAB_ONE;
+		t = t > 216.0 / 24389.0 ? cbrt(t) : t * 24389.0 / 3132.0 + 16.0 / 116.0;
+		lab_f[i] = lround(t * LAB_ONE);
+	}
+}
+
+static int lab_f_lookup(long long t) {
+	return lab_f[t < LAB_F_SIZE ? t : LAB_F_SIZE - 1];
+}
+
+/* sRGB to CIELAB, D65 white */
+static void lab_from_rgb(unsigned char r, unsigned char g, unsigned char b, int lab[3]) {
+	long long lr = lab_linear[r];
+	long long lg = lab_linear[g];
+	long long lb = lab_linear[b];
+	int fx, fy, fz;
+
+	/* rows of the sRGB to XYZ matrix divided by the white point, x 4096 */
+	fx = lab_f_lookup((1777 * lr + 1541 * lg + 778 * lb) >> LAB_SHIFT);
+	fy = lab_f_lookup((871 * lr + 2929 * lg + 296 * lb) >> LAB_SHIFT);
+	fz = lab_f_lookup((73 * lr + 448 * lg + 3575 * lb) >> LAB_SHIFT);
+
+	lab[0] = 116 * fy - 16 * LAB_ONE;
+	lab[1] = 500 * (fx - fy);
+	lab[2] = 200 * (fy - fz);
+}
+
+/* whether r, g, b should go out, updates the suppression state */
+static int suppression_check(struct libambxlight_suppression *suppression, unsigned char r, unsigned char g, unsigned char b, int lab[3]) {
+	long long distance = 0;
+	long long threshold;
+	long long d;
+	int i;
+
+	lab_from_rgb(r, g, b, lab);
+	if (!suppression->known) {
+		return 1;
+	}
+	if (suppression->max_age && frame_clock() - suppression->sent_at >= suppression->max_age * 1000000LL) {
+		return 1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		d = lab[i] - suppression->lab[i];
+		distance += d * d;
+	}
+	threshold = (long long)suppression->threshold * LAB_ONE / 100;
+	return distance >= threshold * threshold;
+}
+
+/* send a color report, unless suppression finds it redundant */
+static int device_write_color(libambxlight_device *device, const unsigned char *data, size_t len) {
+	struct libambxlight_suppression *suppression = device->suppression;
+	int lab[3];
+	int retval;
+
+	if (!suppression) {
+		return device_write_all(device, data, len);
+	}
+
+	if (!suppression_check(suppression, data[2], data[3], data[4], lab)) {
+		suppression->stats.suppressed++;
+		return 0;
+	}
+
+	retval = device_write_all(device, data, len);
+	if (retval == 0) {
+		memcpy(suppression->lab, lab, sizeof(suppression->lab));
+		suppression->known = 1;
+		suppression->sent_at = frame_clock();
+		suppression->stats.sent++;
+	}
+	return retval;
+}
+
+/*
+ * suppress colors less than threshold hundredths of delta E away from the
+ * last one sent, but resend after max_age msec. a threshold of 0 turns
+ * suppression off and drops its counters.
+ */
+int libambxlight_set_color_suppression(libambxlight_device *device, unsigned int threshold, unsigned int max_age) {
+	if (!threshold) {
+		free(device->suppression);
+		device->suppression = NULL;
+		return 0;
+	}
+
+	pthread_once(&lab_once, lab_init);
+	if (!device->suppression) {
+		device->suppression = calloc(1, sizeof(*device->suppression));
+		if (!device->suppression) {
+			return -1;
+		}
+	}
+	device->suppression->threshold = threshold;
+	device->suppression->max_age = max_age;
+	return 0;
+}
+
+void libambxlight_get_suppression_stats(libambxlight_device *device, libambxlight_suppression_stats *stats) {
+	if (device->suppression) {
+		*stats = device->suppression->stats;
+	} else {
+		memset(stats, 0, sizeof(*stats));
+	}
+}
+
+int libambxlight_change_color_rgb(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b) {
 	unsigned char data[9] = {
 		0xa2,
 		0x00,
@@ -108,10 +274,10 @@ void libambxlight_change_color_rgb(libambxlight_device device, unsigned char r,
 		0x00,
 		0x00
 	};
-	write(device.fd, data, sizeof(data));
+	return device_write_color(&device, data, sizeof(data));
 }
 
-void libambxlight_change_color_rgb_with_fade(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
+int libambxlight_change_color_rgb_with_fade(libambxlight_device device, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
 	unsigned char data[9] = {
 		0xa2,
 		0x00,
@@ -123,40 +289,62 @@ void libambxlight_change_color_rgb_with_fade(libambxlight_device device, unsigne
 		0x00,
 		0x00
 	};
-	write(device.fd, data, sizeof(data));
+	return device_write_color(&device, data, sizeof(data));
 }
 
-void libambxlight_set_device_state(libambxlight_device *device, unsigned char state) {
+/*
+ * stream a color, newest color wins. the module sends it over the
+ * interrupt endpoint when the pod has one, other transports send it as a
+ * plain color report.
+ */
+int libambxlight_stream_color_rgb(libambxlight_device *device, unsigned char r, unsigned char g, unsigned char b) {
+	unsigned char data[3] = {
+		r,
+		g,
+		b
+	};
+
+	if (device_transport(device) != &libambxlight_kernel_transport) {
+		return libambxlight_change_color_rgb(*device, r, g, b);
+	}
+
+	if (device->mode != STREAM) {
+		libambxlight_set_device_write_mode(device, STREAM);
+	}
+	return device_write(device, data, sizeof(data)) < 0 ? -1 : 0;
+}
+
+int libambxlight_set_device_state(libambxlight_device *device, unsigned char state) {
 	unsigned char data[3] = {
 		0xa1,
 		0x00,
 		state
 	};
 	device->params.param.enabled = state;
-	write(device->fd, data, sizeof(data));
+	return device_write_all(device, data, sizeof(data));
 }
 
-void libambxlight_set_device_intensity(libambxlight_device *device, unsigned char intensity) {
+int libambxlight_set_device_intensity(libambxlight_device *device, unsigned char intensity) {
 	unsigned char data[3] = {
 		0xa6,
 		0x00,
 		intensity
 	};
 	device->params.param.intensity = intensity;
-	write(device->fd, data, sizeof(data));
+	return device_write_all(device, data, sizeof(data));
 }
 
-void libambxlight_set_device_height(libambxlight_device *device, unsigned char height) {
+int libambxlight_set_device_height(libambxlight_device *device, unsigned char height) {
 	unsigned char data[3] = {
 		0xa5,
 		0x00,
 		height
 	};
 	device->params.param.height = height;
-	write(device->fd, data, sizeof(data));
+	return device_write_all(device, data, sizeof(data));
 }
 
-void libambxlight_set_device_location(libambxlight_device *device, unsigned char location) {
+int libambxlight_set_device_location(libambxlight_device *device, unsigned char location) {
 	unsigned char data[4] = {
 		0xa4,
 		0x00,
@@ -165,9 +353,329 @@ void libambxlight_set_device_location(libambxlight_device *device, unsigned char
 	};
 	device->params.param.location = location;
 	device->params.param.center = location ? 0x00 : 0x01;
-	write(device->fd, data, sizeof(data));
+	return device_write_all(device, data, sizeof(data));
 }
 
 int libambxlight_get_params(libambxlight_device *device) {
-	return read(device->fd, &device->params, sizeof(device->params));
+	return device_transport(device)->read_params(device);
+}
+
+int libambxlight_apply_device_state(libambxlight_device *device, const libambxlight_state *state) {
+	int retval = ioctl(device->fd, AMBXLIGHT_IOCTL_STATE, state);
+	if (retval < 0) {
+		return retval;
+	}
+
+	if (state->mask & STATE_ENABLED) {
+		device->params.param.enabled = state->enabled;
+	}
+	if (state->mask & STATE_LOCATION) {
+		device->params.param.location = state->location;
+		device->params.param.center = state->location ? 0x00 : 0x01;
+	}
+	if (state->mask & STATE_HEIGHT) {
+		device->params.param.height = state->height;
+	}
+	if (state->mask & STATE_INTENSITY) {
+		device->params.param.intensity = state->intensity;
+	}
+	return retval;
+}
+
+libambxlight_shared *libambxlight_map_shared_register(libambxlight_device *device) {
+	void *shared = mmap(NULL, sizeof(libambxlight_shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED, device->fd, 0);
+	if (shared == MAP_FAILED) {
+		return NULL;
+	}
+	return (libambxlight_shared *)shared;
+}
+
+void libambxlight_unmap_shared_register(libambxlight_shared *shared) {
+	munmap(shared, sizeof(libambxlight_shared));
+}
+
+/* single producer, the driver reads the register seqlock style */
+void libambxlight_shared_change_color_rgb_with_fade(libambxlight_shared *shared, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
+	unsigned int sequence = shared->sequence;
+
+	__atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&shared->red, r, __ATOMIC_RELAXED);
+	__atomic_store_n(&shared->green, g, __ATOMIC_RELAXED);
+	__atomic_store_n(&shared->blue, b, __ATOMIC_RELAXED);
+	__atomic_store_n(&shared->fade, msec & 0xffff, __ATOMIC_RELAXED);
+	__atomic_store_n(&shared->generation, shared->generation + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int libambxlight_kick_device(libambxlight_device *device) {
+	return ioctl(device->fd, AMBXLIGHT_IOCTL_KICK);
+}
+
+void libambxlight_set_device_poll_interval(libambxlight_device *device, unsigned int msec) {
+	ioctl(device->fd, AMBXLIGHT_IOCTL_POLL, &msec);
+}
+
+int libambxlight_play_effect(libambxlight_device *device, const libambxlight_keyframe *frames, unsigned int count, unsigned int flags) {
+	struct libambxlight_effect effect;
+
+	if (count > LIBAMBXLIGHT_EFFECT_MAX_FRAMES) {
+		return -1;
+	}
+	memset(&effect, 0, sizeof(effect));
+	effect.flags = flags;
+	effect.count = count;
+	if (count) {
+		memcpy(effect.frames, frames, count * sizeof(*frames));
+	}
+
+	return ioctl(device->fd, AMBXLIGHT_IOCTL_EFFECT, &effect);
+}
+
+int libambxlight_stop_effect(libambxlight_device *device) {
+	return libambxlight_play_effect(device, NULL, 0, 0);
+}
+
+void libambxlight_scheduled_color_rgb_with_fade(libambxlight_scheduled *entry, long long timestamp, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
+	memset(entry, 0, sizeof(*entry));
+	entry->timestamp = timestamp;
+	entry->report[0] = 0xa2;
+	entry->report[2] = r;
+	entry->report[3] = g;
+	entry->report[4] = b;
+	entry->report[5] = msec & 0xff;
+	entry->report[6] = (msec >> 8) & 0xff;
+}
+
+ssize_t libambxlight_schedule_colors(libambxlight_device *device, const libambxlight_scheduled *entries, unsigned int count) {
+	ssize_t written;
+
+	if (device->mode != SCHEDULED) {
+		libambxlight_set_device_write_mode(device, SCHEDULED);
+	}
+	written = write(device->fd, entries, count * sizeof(*entries));
+	if (written < 0) {
+		return written;
+	}
+	return written / sizeof(*entries);
+}
+
+int libambxlight_get_lateness(libambxlight_device *device, libambxlight_lateness *report) {
+	return ioctl(device->fd, AMBXLIGHT_IOCTL_LATENESS, report);
+}
+
+void libambxlight_set_schedule_tolerance(libambxlight_device *device, unsigned int usec) {
+	ioctl(device->fd, AMBXLIGHT_IOCTL_TOLERANCE, &usec);
+}
+
+void libambxlight_set_hexstream_rate(libambxlight_device *device, unsigned int colors_per_second) {
+	ioctl(device->fd, AMBXLIGHT_IOCTL_RATE, &colors_per_second);
+}
+
+int libambxlight_set_device_group(libambxlight_device *device, const int *minors, unsigned int count) {
+	struct libambxlight_group group;
+
+	if (count > LIBAMBXLIGHT_GROUP_MAX) {
+		return -1;
+	}
+	memset(&group, 0, sizeof(group));
+	group.count = count;
+	if (count) {
+		memcpy(group.minors, minors, count * sizeof(*minors));
+	}
+
+	return ioctl(device->fd, AMBXLIGHT_IOCTL_GROUP, &group);
+}
+
+int libambxlight_push_group_frame(libambxlight_device *device, const libambxlight_keyframe *colors, unsigned int count) {
+	struct libambxlight_group_frame frame;
+
+	if (count == 0 || count > LIBAMBXLIGHT_GROUP_MAX) {
+		return -1;
+	}
+	memset(&frame, 0, sizeof(frame));
+	frame.count = count;
+	memcpy(frame.colors, colors, count * sizeof(*colors));
+
+	return ioctl(device->fd, AMBXLIGHT_IOCTL_GROUP_FRAME, &frame);
+}
+
+static long long frame_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* make the devices a sync group, so that a commit is a single ioctl */
+static int frame_group(libambxlight_frame *frame) {
+	int minors[LIBAMBXLIGHT_GROUP_MAX];
+	unsigned int i;
+
+	if (frame->count < 2 || frame->count > LIBAMBXLIGHT_GROUP_MAX) {
+		return 0;
+	}
+	for (i = 0; i < frame->count; i++) {
+		/* groups live in the module */
+		if (device_transport(frame->pods[i].device) != &libambxlight_kernel_transport) {
+			return 0;
+		}
+		minors[i] = frame->pods[i].device->minor;
+	}
+
+	return libambxlight_set_device_group(frame->pods[0].device, minors, frame->count) == 0;
+}
+
+int libambxlight_frame_begin(libambxlight_frame *frame, libambxlight_device **devices, unsigned int count) {
+	unsigned int i;
+
+	if (count > LIBAMBXLIGHT_FRAME_MAX) {
+		return -1;
+	}
+
+	/* the same devices as last time keep their colors and group */
+	for (i = 0; i < count && count == frame->count; i++) {
+		if (frame->pods[i].device != devices[i]) {
+			break;
+		}
+	}
+	if (i < count || count != frame->count) {
+		memset(frame, 0, sizeof(*frame));
+		frame->count = count;
+		for (i = 0; i < count; i++) {
+			frame->pods[i].device = devices[i];
+		}
+		frame->grouped = frame_group(frame);
+	}
+
+	for (i = 0; i < count; i++) {
+		frame->pods[i].set = 0;
+		frame->pods[i].result = 1;
+	}
+	return 0;
+}
+
+int libambxlight_frame_set(libambxlight_frame *frame, unsigned int index, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
+	unsigned char *report;
+
+	if (index >= frame->count) {
+		return -1;
+	}
+
+	report = frame->pods[index].report;
+	report[0] = 0xa2;
+	report[1] = 0x00;
+	report[2] = r;
+	report[3] = g;
+	report[4] = b;
+	report[5] = msec & 0xff;
+	report[6] = (msec >> 8) & 0xff;
+	report[7] = 0x00;
+	report[8] = 0x00;
+	frame->pods[index].set = 1;
+	return 0;
+}
+
+/* send the whole frame with one AMBXLIGHT_IOCTL_GROUP_FRAME */
+static int frame_commit_group(libambxlight_frame *frame) {
+	libambxlight_keyframe colors[LIBAMBXLIGHT_GROUP_MAX];
+	const unsigned char *report;
+	unsigned int i;
+	int retval;
+
+	memset(colors, 0, sizeof(colors));
+	for (i = 0; i < frame->count; i++) {
+		report = frame->pods[i].report;
+		colors[i].red = report[2];
+		colors[i].green = report[3];
+		colors[i].blue = report[4];
+		colors[i].fade = report[5] | report[6] << 8;
+	}
+
+	frame->syscalls++;
+	retval = libambxlight_push_group_frame(frame->pods[0].device, colors, frame->count);
+	for (i = 0; i < frame->count; i++) {
+		frame->pods[i].result = retval < 0 ? -1 : 0;
+	}
+	return retval < 0 ? -1 : (int)frame->count;
+}
+
+/*
+ * send the colors set since libambxlight_frame_begin(). a group frame
+ * goes out as a single ioctl, which resends the unchanged colors of the
+ * devices not set, otherwise each device set gets one write. returns the
+ * number of devices sent to or -1 if none could be.
+ */
+int libambxlight_frame_commit(libambxlight_frame *frame) {
+	unsigned int i;
+	int grouped = frame->grouped;
+	int sent = 0;
+	int failed = 0;
+
+	frame->syscalls = 0;
+	frame->commit_start = frame_clock();
+
+	/* a group frame needs a color for every device */
+	for (i = 0; i < frame->count && grouped; i++) {
+		grouped = frame->pods[i].report[0] == 0xa2;
+	}
+
+	if (grouped) {
+		sent = frame_commit_group(frame);
+	} else {
+		for (i = 0; i < frame->count; i++) {
+			if (!frame->pods[i].set) {
+				continue;
+			}
+			frame->syscalls++;
+			if (device_write_all(frame->pods[i].device, frame->pods[i].report, sizeof(frame->pods[i].report)) == 0) {
+				frame->pods[i].result = 0;
+				sent++;
+			} else {
+				frame->pods[i].result = -1;
+				failed++;
+			}
+		}
+		if (!sent && failed) {
+			sent = -1;
+		}
+	}
+
+	frame->commit_duration = frame_clock() - frame->commit_start;
+	return sent;
+}
+
+/*
+ * like libambxlight_frame_commit(), but the writes are queued on ring and
+ * submitted with one syscall. a result of 0 only means queued, the
+ * outcome of each write comes from libambxlight_uring_reap().
+ */
+int libambxlight_frame_commit_uring(libambxlight_frame *frame, libambxlight_uring *ring) {
+	unsigned int i;
+	int queued = 0;
+
+	frame->syscalls = 0;
+	frame->commit_start = frame_clock();
+
+	for (i = 0; i < frame->count; i++) {
+		if (!frame->pods[i].set) {
+			continue;
+		}
+		if (libambxlight_uring_queue_write(ring, frame->pods[i].device, frame->pods[i].report, sizeof(frame->pods[i].report)) == 0) {
+			frame->pods[i].result = 0;
+			queued++;
+		} else {
+			frame->pods[i].result = -1;
+		}
+	}
+	if (queued) {
+		frame->syscalls++;
+		if (libambxlight_uring_submit(ring) < 0) {
+			queued = -1;
+		}
+	}
+
+	frame->commit_duration = frame_clock() - frame->commit_start;
+	return queued;
 }
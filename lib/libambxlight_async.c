@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <libambxlight/libambxlight.h>
+
+/*
+ * Thread-safe handle. Producers publish the state they want into two
+ * 64-bit latest-value slots with atomic operations only, and a writer
+ * thread owning the device takes the slots and sends what they hold.
+ * A producer never waits for the device, and states published while the
+ * writer is busy are merged, only the newest value of each field is sent.
+ */
+
+/* color slot: valid bit, fade, red, green, blue */
+#define ASYNC_COLOR_VALID (1ULL << 63)
+
+/* params slot: the STATE_* bits of the fields present, above their values */
+#define ASYNC_PARAMS_MASK_SHIFT 32
+#define ASYNC_PARAMS_FIELDS (STATE_ENABLED | STATE_LOCATION | STATE_HEIGHT | STATE_INTENSITY)
+
+/* RAW write holding at most one report of each kind */
+#define ASYNC_MAX_WRITE (9 + 3 + 4 + 3 + 3)
+
+struct libambxlight_async {
+	libambxlight_device *device;
+	pthread_t writer;
+	int eventfd; /* wakes the writer */
+	uint64_t color; /* latest color, 0 if taken */
+	uint64_t params; /* latest parameters, 0 if taken */
+	int wake_pending; /* the writer has been woken and hasn't drained yet */
+	int stop;
+	int error; /* errno of the last failed write, 0 if none */
+};
+
+static const struct libambxlight_transport *async_transport(libambxlight_device *device) {
+	return device->transport ? device->transport : &libambxlight_kernel_transport;
+}
+
+/* the fields take a byte each, in STATE_* order */
+static unsigned int async_params_shift(unsigned int field) {
+	return 8 * (__builtin_ffs(field) - __builtin_ffs(STATE_ENABLED));
+}
+
+static uint64_t async_params_field(unsigned int field, unsigned char value) {
+	return (uint64_t)field << ASYNC_PARAMS_MASK_SHIFT | (uint64_t)value << async_params_shift(field);
+}
+
+static unsigned char async_params_value(uint64_t params, unsigned int field) {
+	return params >> async_params_shift(field) & 0xff;
+}
+
+static void async_wake(libambxlight_async *async) {
+	uint64_t one = 1;
+
+	/*
+	 * one wakeup per drain is enough. sequentially consistent, like the
+	 * publication of the slot before and the drain's clear then take:
+	 * either this sees the flag cleared or the drain sees the new value.
+	 */
+	if (__atomic_exchange_n(&async->wake_pending, 1, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	if (write(async->eventfd, &one, sizeof(one)) < 0) {
+		/* can only fail on overflow, the writer is awake then */
+	}
+}
+
+/* send what the slots hold as a single RAW write */
+static void async_drain(libambxlight_async *async) {
+	unsigned char data[ASYNC_MAX_WRITE];
+	libambxlight_device *device = async->device;
+	uint64_t color;
+	uint64_t params;
+	unsigned int mask;
+	unsigned char location;
+	size_t len = 0;
+
+	/* the slots are taken one after the other, see async_wake() */
+	__atomic_store_n(&async->wake_pending, 0, __ATOMIC_SEQ_CST);
+	params = __atomic_exchange_n(&async->params, 0, __ATOMIC_SEQ_CST);
+	color = __atomic_exchange_n(&async->color, 0, __ATOMIC_SEQ_CST);
+
+	mask = params >> ASYNC_PARAMS_MASK_SHIFT;
+	if (mask & STATE_ENABLED) {
+		data[len++] = 0xa1;
+		data[len++] = 0x00;
+		data[len++] = async_params_value(params, STATE_ENABLED);
+		device->params.param.enabled = data[len - 1];
+	}
+	if (mask & STATE_LOCATION) {
+		location = async_params_value(params, STATE_LOCATION);
+		data[len++] = 0xa4;
+		data[len++] = 0x00;
+		data[len++] = location;
+		data[len++] = location ? 0x00 : 0x01;
+		device->params.param.location = location;
+		device->params.param.center = location ? 0x00 : 0x01;
+	}
+	if (mask & STATE_HEIGHT) {
+		data[len++] = 0xa5;
+		data[len++] = 0x00;
+		data[len++] = async_params_value(params, STATE_HEIGHT);
+		device->params.param.height = data[len - 1];
+	}
+	if (mask & STATE_INTENSITY) {
+		data[len++] = 0xa6;
+		data[len++] = 0x00;
+		data[len++] = async_params_value(params, STATE_INTENSITY);
+		device->params.param.intensity = data[len - 1];
+	}
+	if (color & ASYNC_COLOR_VALID) {
+		data[len++] = 0xa2;
+		data[len++] = 0x00;
+		data[len++] = color >> 16 & 0xff;
+		data[len++] = color >> 8 & 0xff;
+		data[len++] = color & 0xff;
+		data[len++] = color >> 24 & 0xff;
+		data[len++] = color >> 32 & 0xff;
+		data[len++] = 0x00;
+		data[len++] = 0x00;
+	}
+
+	if (len && async_transport(device)->write(device, data, len) != (ssize_t)len) {
+		__atomic_store_n(&async->error, errno ? errno : EIO, __ATOMIC_RELEASE);
+	}
+}
+
+static void *async_writer(void *arg) {
+	libambxlight_async *async = arg;
+	uint64_t count;
+
+	while (!__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE)) {
+		if (read(async->eventfd, &count, sizeof(count)) < 0 && errno != EINTR) {
+			break;
+		}
+		async_drain(async);
+	}
+
+	/* what was published before close still goes out */
+	async_drain(async);
+	return NULL;
+}
+
+/*
+ * start a writer thread for an open device. the device belongs to the
+ * writer until libambxlight_async_close(), which doesn't close it.
+ */
+libambxlight_async *libambxlight_async_open(libambxlight_device *device) {
+	libambxlight_async *async;
+
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		return NULL;
+	}
+	async->device = device;
+
+	async->eventfd = eventfd(0, EFD_CLOEXEC);
+	if (async->eventfd < 0) {
+		free(async);
+		return NULL;
+	}
+	if (pthread_create(&async->writer, NULL, async_writer, async)) {
+		close(async->eventfd);
+		free(async);
+		return NULL;
+	}
+
+	return async;
+}
+
+void libambxlight_async_close(libambxlight_async *async) {
+	uint64_t one = 1;
+
+	__atomic_store_n(&async->stop, 1, __ATOMIC_RELEASE);
+	if (write(async->eventfd, &one, sizeof(one)) < 0) {
+		/* can only fail on overflow, the writer is awake then */
+	}
+	pthread_join(async->writer, NULL);
+	close(async->eventfd);
+	free(async);
+}
+
+void libambxlight_async_set_color(libambxlight_async *async, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
+	uint64_t color = ASYNC_COLOR_VALID | (uint64_t)(msec & 0xffff) << 24 | r << 16 | g << 8 | b;
+
+	/* the newest color replaces one the writer hasn't taken yet */
+	__atomic_store_n(&async->color, color, __ATOMIC_SEQ_CST);
+	async_wake(async);
+}
+
+/* publish the fields of state in its mask, merged with those not sent yet */
+void libambxlight_async_set_state(libambxlight_async *async, const libambxlight_state *state) {
+	uint64_t fields = 0;
+	uint64_t clear = 0;
+	uint64_t old, new;
+	unsigned int field;
+
+	if (state->mask & STATE_COLOR) {
+		libambxlight_async_set_color(async, state->red, state->green, state->blue, state->fade);
+	}
+
+	for (field = STATE_ENABLED; field & ASYNC_PARAMS_FIELDS; field <<= 1) {
+		if (!(state->mask & field)) {
+			continue;
+		}
+		switch (field) {
+		case STATE_ENABLED:
+			fields |= async_params_field(field, state->enabled);
+			break;
+		case STATE_LOCATION:
+			fields |= async_params_field(field, state->location);
+			break;
+		case STATE_HEIGHT:
+			fields |= async_params_field(field, state->height);
+			break;
+		case STATE_INTENSITY:
+			fields |= async_params_field(field, state->intensity);
+			break;
+		}
+		clear |= async_params_field(field, 0xff);
+	}
+	if (!fields) {
+		return;
+	}
+
+	old = __atomic_load_n(&async->params, __ATOMIC_RELAXED);
+	do {
+		new = (old & ~clear) | fields;
+	} while (!__atomic_compare_exchange_n(&async->params, &old, new, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	async_wake(async);
+}
+
+/* errno of the last failed write, cleared by reading it */
+int libambxlight_async_error(libambxlight_async *async) {
+	return __atomic_exchange_n(&async->error, 0, __ATOMIC_ACQ_REL);
+}
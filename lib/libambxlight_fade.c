@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libambxlight/libambxlight.h>
+
+/*
+ * Fade planner. The device fades linearly from the color it shows to the
+ * one of a 0xa2 report over up to 65535 msec, so a color curve can be
+ * sent as a few faded keyframes instead of a stream of intermediate
+ * colors. Each keyframe is stretched over as many curve points as it can
+ * cover without the fade straying more than max_error from any of them.
+ * Between points the curve is linear, so checking the points is enough.
+ */
+
+#define FADE_MAX 0xffff /* msec, the fade field of the report */
+#define FADE_DEFAULT_STEP 16 /* msec, what 60 Hz streaming would send */
+
+struct fade_plan {
+	libambxlight_keyframe *frames;
+	unsigned int count;
+	unsigned int max;
+};
+
+/* channel of the line from (t0, c0) to (t1, c1) at t */
+static int fade_lerp(unsigned int t0, int c0, unsigned int t1, int c1, unsigned int t) {
+	long long span = t1 - t0;
+	long long delta = (long long)(c1 - c0) * (t - t0);
+
+	/* round to nearest */
+	return c0 + (delta >= 0 ? delta + span / 2 : delta - span / 2) / span;
+}
+
+static int fade_within(const libambxlight_curve_point *from, const libambxlight_curve_point *to, const libambxlight_curve_point *point, unsigned int max_error) {
+	return abs(fade_lerp(from->time, from->red, to->time, to->red, point->time) - point->red) <= (int)max_error &&
+		abs(fade_lerp(from->time, from->green, to->time, to->green, point->time) - point->green) <= (int)max_error &&
+		abs(fade_lerp(from->time, from->blue, to->time, to->blue, point->time) - point->blue) <= (int)max_error;
+}
+
+static int fade_emit(struct fade_plan *plan, const libambxlight_curve_point *point, unsigned int fade) {
+	libambxlight_keyframe *last = plan->count ? &plan->frames[plan->count - 1] : NULL;
+
+	/* fading to the color already shown is holding it */
+	if (last && last->red == point->red && last->green == point->green && last->blue == point->blue &&
+			last->hold + fade <= FADE_MAX) {
+		last->hold += fade;
+		return 0;
+	}
+
+	if (plan->count == plan->max) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memset(&plan->frames[plan->count], 0, sizeof(plan->frames[plan->count]));
+	plan->frames[plan->count].red = point->red;
+	plan->frames[plan->count].green = point->green;
+	plan->frames[plan->count].blue = point->blue;
+	plan->frames[plan->count].fade = fade;
+	plan->count++;
+	return 0;
+}
+
+/*
+ * plan the keyframes for the curve through points, whose times must
+ * increase. the first keyframe sets the color of the first point at
+ * once. returns the number of keyframes, or -1 with errno set to ENOSPC
+ * if more than max are needed.
+ */
+ssize_t libambxlight_plan_fade(const libambxlight_curve_point *points, unsigned int count, unsigned int max_error, libambxlight_keyframe *frames, unsigned int max) {
+	struct fade_plan plan = {
+		.frames = frames,
+		.max = max,
+	};
+	libambxlight_curve_point start;
+	libambxlight_curve_point split;
+	unsigned int next;
+	unsigned int end;
+	unsigned int i;
+	int best;
+
+	if (!count) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 1; i < count; i++) {
+		if (points[i].time <= points[i - 1].time) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	start = points[0];
+	if (fade_emit(&plan, &start, 0) < 0) {
+		return -1;
+	}
+
+	/* greedy, each keyframe reaches the furthest point it can */
+	next = 1;
+	while (next < count) {
+		best = -1;
+		for (end = next; end < count && points[end].time - start.time <= FADE_MAX; end++) {
+			for (i = next; i < end; i++) {
+				if (!fade_within(&start, &points[end], &points[i], max_error)) {
+					break;
+				}
+			}
+			if (i < end) {
+				break;
+			}
+			best = end;
+		}
+
+		if (best < 0) {
+			/* the next point is further than a fade can go, stop on the way */
+			memset(&split, 0, sizeof(split));
+			split.time = start.time + FADE_MAX;
+			split.red = fade_lerp(points[next - 1].time, points[next - 1].red, points[next].time, points[next].red, split.time);
+			split.green = fade_lerp(points[next - 1].time, points[next - 1].green, points[next].time, points[next].green, split.time);
+			split.blue = fade_lerp(points[next - 1].time, points[next - 1].blue, points[next].time, points[next].blue, split.time);
+			if (fade_emit(&plan, &split, FADE_MAX) < 0) {
+				return -1;
+			}
+			start = split;
+			continue;
+		}
+
+		if (fade_emit(&plan, &points[best], points[best].time - start.time) < 0) {
+			return -1;
+		}
+		start = points[best];
+		next = best + 1;
+	}
+
+	return plan.count;
+}
+
+/*
+ * plan the keyframes for a curve computed by callback, sampled every step
+ * msec (16 if 0) from 0 to duration.
+ */
+ssize_t libambxlight_plan_fade_callback(libambxlight_curve_callback callback, void *arg, unsigned int duration, unsigned int step, unsigned int max_error, libambxlight_keyframe *frames, unsigned int max) {
+	libambxlight_curve_point *points;
+	unsigned int count = 0;
+	unsigned int time;
+	ssize_t retval;
+
+	if (!step) {
+		step = FADE_DEFAULT_STEP;
+	}
+
+	points = calloc(duration / step + 2, sizeof(*points));
+	if (!points) {
+		return -1;
+	}
+	for (time = 0;; time += step) {
+		if (time > duration) {
+			time = duration;
+		}
+		points[count].time = time;
+		callback(time, &points[count].red, &points[count].green, &points[count].blue, arg);
+		count++;
+		if (time == duration) {
+			break;
+		}
+	}
+
+	retval = libambxlight_plan_fade(points, count, max_error, frames, max);
+	free(points);
+	return retval;
+}
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <libambxlight/libambxlight.h>
+
+/*
+ * Registry of the pods bound to the ambxlight module. Pods are found
+ * through sysfs without opening them, handles are opened on first use and
+ * kept, and the kernel's uevents keep the registry up to date as pods come
+ * and go.
+ */
+
+#define REGISTRY_DRIVER_DIR "/sys/bus/usb/drivers/cyborg_ambx_light"
+#define REGISTRY_NODE_PREFIX "ambx_light"
+#define REGISTRY_UEVENT_SIZE 4096
+
+struct registry_entry {
+	int minor;
+	libambxlight_device *device; /* opened on first use, NULL before */
+};
+
+struct libambxlight_registry {
+	int fd; /* uevent netlink socket */
+	struct registry_entry *entries;
+	size_t count;
+	size_t size;
+	libambxlight_hotplug_callback callback;
+	void *callback_arg;
+};
+
+/* minor of a node name like ambx_light3, -1 if it isn't one */
+static int registry_node_minor(const char *name) {
+	char *end;
+	long minor;
+
+	if (strncmp(name, REGISTRY_NODE_PREFIX, strlen(REGISTRY_NODE_PREFIX))) {
+		return -1;
+	}
+	name += strlen(REGISTRY_NODE_PREFIX);
+	minor = strtol(name, &end, 10);
+	if (end == name || *end || minor < 0) {
+		return -1;
+	}
+	return minor;
+}
+
+/*
+ * call found for each pod bound to the module. only the interfaces the
+ * module is bound to are looked at, so this is O(pods).
+ */
+static int registry_scan(void (*found)(int minor, void *arg), void *arg) {
+	DIR *driver;
+	DIR *nodes;
+	struct dirent *interface;
+	struct dirent *node;
+	char name[512];
+	int minor;
+
+	driver = opendir(REGISTRY_DRIVER_DIR);
+	if (!driver) {
+		/* module not loaded, no pods */
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	while ((interface = readdir(driver))) {
+		/* interfaces are named like 1-2:1.0, the rest are driver attributes */
+		if (!strchr(interface->d_name, ':')) {
+			continue;
+		}
+		snprintf(name, sizeof(name), REGISTRY_DRIVER_DIR "/%s/usbmisc", interface->d_name);
+		nodes = opendir(name);
+		if (!nodes) {
+			continue;
+		}
+		while ((node = readdir(nodes))) {
+			minor = registry_node_minor(node->d_name);
+			if (minor >= 0) {
+				found(minor, arg);
+			}
+		}
+		closedir(nodes);
+	}
+
+	closedir(driver);
+	return 0;
+}
+
+static struct registry_entry *registry_find(libambxlight_registry *registry, int minor) {
+	size_t i;
+
+	for (i = 0; i < registry->count; i++) {
+		if (registry->entries[i].minor == minor) {
+			return &registry->entries[i];
+		}
+	}
+	return NULL;
+}
+
+static int registry_add(libambxlight_registry *registry, int minor) {
+	struct registry_entry *entries;
+	size_t size;
+
+	if (registry_find(registry, minor)) {
+		return 0;
+	}
+
+	if (registry->count == registry->size) {
+		size = registry->size ? registry->size * 2 : 8;
+		entries = realloc(registry->entries, size * sizeof(*entries));
+		if (!entries) {
+			return -1;
+		}
+		registry->entries = entries;
+		registry->size = size;
+	}
+
+	registry->entries[registry->count].minor = minor;
+	registry->entries[registry->count].device = NULL;
+	registry->count++;
+
+	if (registry->callback) {
+		registry->callback(minor, 1, registry->callback_arg);
+	}
+	return 1;
+}
+
+static int registry_remove(libambxlight_registry *registry, int minor) {
+	struct registry_entry *entry = registry_find(registry, minor);
+
+	if (!entry) {
+		return 0;
+	}
+
+	/* let the caller drop the handle before it goes */
+	if (registry->callback) {
+		registry->callback(minor, 0, registry->callback_arg);
+	}
+	if (entry->device) {
+		libambxlight_device_close(*entry->device);
+		free(entry->device);
+	}
+	*entry = registry->entries[--registry->count];
+	return 1;
+}
+
+static void registry_found(int minor, void *arg) {
+	registry_add(arg, minor);
+}
+
+/* bring the registry back in line with sysfs after uevents were lost */
+static int registry_resync(libambxlight_registry *registry) {
+	libambxlight_registry present = {
+		.fd = -1,
+	};
+	size_t i;
+	int changes = 0;
+
+	if (registry_scan(registry_found, &present) < 0) {
+		free(present.entries);
+		return 0;
+	}
+
+	for (i = registry->count; i-- > 0;) {
+		if (!registry_find(&present, registry->entries[i].minor)) {
+			changes += registry_remove(registry, registry->entries[i].minor);
+		}
+	}
+	for (i = 0; i < present.count; i++) {
+		changes += registry_add(registry, present.entries[i].minor) > 0;
+	}
+
+	free(present.entries);
+	return changes;
+}
+
+libambxlight_registry *libambxlight_registry_open(void) {
+	struct sockaddr_nl address = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* events sent by the kernel */
+	};
+	libambxlight_registry *registry;
+
+	registry = calloc(1, sizeof(*registry));
+	if (!registry) {
+		return NULL;
+	}
+
+	/* listen first, so that no pod slips between the scan and the socket */
+	registry->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+	if (registry->fd < 0) {
+		free(registry);
+		return NULL;
+	}
+	if (bind(registry->fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			registry_scan(registry_found, registry) < 0) {
+		close(registry->fd);
+		free(registry->entries);
+		free(registry);
+		return NULL;
+	}
+
+	return registry;
+}
+
+void libambxlight_registry_close(libambxlight_registry *registry) {
+	size_t i;
+
+	for (i = 0; i < registry->count; i++) {
+		if (registry->entries[i].device) {
+			libambxlight_device_close(*registry->entries[i].device);
+			free(registry->entries[i].device);
+		}
+	}
+	close(registry->fd);
+	free(registry->entries);
+	free(registry);
+}
+
+void libambxlight_registry_set_callback(libambxlight_registry *registry, libambxlight_hotplug_callback callback, void *arg) {
+	registry->callback = callback;
+	registry->callback_arg = arg;
+}
+
+int libambxlight_registry_fd(libambxlight_registry *registry) {
+	return registry->fd;
+}
+
+/* apply one uevent, returns 1 if a pod came or went */
+static int registry_uevent(libambxlight_registry *registry, const char *buffer, size_t len) {
+	const char *action = NULL;
+	const char *subsystem = NULL;
+	const char *devpath = NULL;
+	const char *field;
+	const char *name;
+	int minor;
+
+	/* header, then KEY=value pairs, all NUL terminated */
+	for (field = buffer + strlen(buffer) + 1; field < buffer + len; field += strlen(field) + 1) {
+		if (!strncmp(field, "ACTION=", 7)) {
+			action = field + 7;
+		} else if (!strncmp(field, "SUBSYSTEM=", 10)) {
+			subsystem = field + 10;
+		} else if (!strncmp(field, "DEVPATH=", 8)) {
+			devpath = field + 8;
+		}
+	}
+	if (!action || !subsystem || !devpath || strcmp(subsystem, "usbmisc")) {
+		return 0;
+	}
+
+	name = strrchr(devpath, '/');
+	minor = registry_node_minor(name ? name + 1 : devpath);
+	if (minor < 0) {
+		return 0;
+	}
+
+	if (!strcmp(action, "add")) {
+		return registry_add(registry, minor) > 0;
+	}
+	if (!strcmp(action, "remove")) {
+		return registry_remove(registry, minor);
+	}
+	return 0;
+}
+
+int libambxlight_registry_process(libambxlight_registry *registry) {
+	char buffer[REGISTRY_UEVENT_SIZE];
+	struct sockaddr_nl sender;
+	struct iovec iov = {
+		.iov_base = buffer,
+		.iov_len = sizeof(buffer) - 1,
+	};
+	struct msghdr message = {
+		.msg_name = &sender,
+		.msg_namelen = sizeof(sender),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t len;
+	int changes = 0;
+
+	for (;;) {
+		message.msg_namelen = sizeof(sender);
+		len = recvmsg(registry->fd, &message, 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				/* events were lost, start over from sysfs */
+				changes += registry_resync(registry);
+				continue;
+			}
+			break;
+		}
+		/* only trust the kernel */
+		if (sender.nl_pid != 0) {
+			continue;
+		}
+		buffer[len] = '\0';
+		changes += registry_uevent(registry, buffer, len);
+	}
+
+	return errno == EAGAIN || errno == EWOULDBLOCK ? changes : -1;
+}
+
+ssize_t libambxlight_registry_minors(libambxlight_registry *registry, int *minors, size_t max) {
+	size_t i;
+
+	for (i = 0; i < registry->count && i < max; i++) {
+		minors[i] = registry->entries[i].minor;
+	}
+	return registry->count;
+}
+
+libambxlight_device *libambxlight_registry_device(libambxlight_registry *registry, int minor) {
+	struct registry_entry *entry = registry_find(registry, minor);
+
+	if (!entry) {
+		return NULL;
+	}
+	if (entry->device) {
+		return entry->device;
+	}
+
+	entry->device = calloc(1, sizeof(*entry->device));
+	if (!entry->device) {
+		return NULL;
+	}
+	entry->device->minor = minor;
+	if (libambxlight_device_open(entry->device) != 0) {
+		free(entry->device);
+		entry->device = NULL;
+	}
+	return entry->device;
+}
+
+ssize_t libambxlight_get_device_list(libambxlight_device ***list) {
+	libambxlight_registry registry = {
+		.fd = -1,
+	};
+	size_t i;
+
+	if (registry_scan(registry_found, &registry) < 0) {
+		free(registry.entries);
+		return -1;
+	}
+
+	/* NULL terminated, for libambxlight_free_device_list() */
+	*list = calloc(registry.count + 1, sizeof(**list));
+	if (!*list) {
+		free(registry.entries);
+		return -1;
+	}
+	for (i = 0; i < registry.count; i++) {
+		(*list)[i] = calloc(1, sizeof(***list));
+		if (!(*list)[i]) {
+			libambxlight_free_device_list(*list);
+			free(registry.entries);
+			return -1;
+		}
+		(*list)[i]->fd = -1;
+		(*list)[i]->minor = registry.entries[i].minor;
+	}
+
+	free(registry.entries);
+	return registry.count;
+}
+
+void libambxlight_free_device_list(libambxlight_device **list) {
+	size_t i;
+
+	for (i = 0; list[i]; i++) {
+		free(list[i]);
+	}
+	free(list);
+}
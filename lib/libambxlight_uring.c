@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <libambxlight/libambxlight.h>
+
+/*
+ * io_uring engine. Writes for any number of devices are queued on the
+ * submission ring and go to the kernel with a single io_uring_enter(),
+ * completions are read off the completion ring without a syscall. Only
+ * devices on the kernel transport can be driven, the writes go to their
+ * fd as they would with write().
+ *
+ * Writes to a character device run on io-wq workers, so two of them in
+ * flight for the same fd could land in either order. Each fd therefore
+ * has at most one write on the rings, the ones queued behind it are held
+ * back and follow, in order, as each one before them completes.
+ */
+
+#define URING_MAX_WRITE 128 /* BATCH_TRANSFER in the module */
+#define URING_NONE (~0U)
+
+/* a write between being queued and its completion being reaped */
+struct uring_slot {
+	libambxlight_device *device; /* NULL while the slot is free */
+	unsigned int next; /* write held back behind this one, or URING_NONE */
+	unsigned int len;
+	unsigned char data[URING_MAX_WRITE];
+};
+
+struct libambxlight_uring {
+	int fd;
+	unsigned int entries;
+
+	/* submission ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int queued; /* sqes not submitted yet */
+
+	/* completion ring, may share the mapping of the submission ring */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* one slot per sqe, so the completion ring can never overflow */
+	struct uring_slot *slots;
+	unsigned int *free_slots;
+	unsigned int nfree;
+	unsigned int held; /* writes waiting for an earlier one to the same fd */
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_unmap(libambxlight_uring *ring) {
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->entries * sizeof(*ring->sqes));
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+}
+
+libambxlight_uring *libambxlight_uring_open(unsigned int entries) {
+	struct io_uring_params params;
+	libambxlight_uring *ring;
+	unsigned char *sq;
+	unsigned char *cq;
+	unsigned int i;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0) {
+		/* no io_uring in this kernel, or not allowed */
+		free(ring);
+		return NULL;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto error;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto error;
+		}
+	}
+	ring->sqes = mmap(NULL, ring->entries * sizeof(*ring->sqes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto error;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	ring->slots = calloc(ring->entries, sizeof(*ring->slots));
+	ring->free_slots = calloc(ring->entries, sizeof(*ring->free_slots));
+	if (!ring->slots || !ring->free_slots) {
+		goto error;
+	}
+	for (i = 0; i < ring->entries; i++) {
+		ring->free_slots[i] = i;
+	}
+	ring->nfree = ring->entries;
+
+	return ring;
+
+error:
+	uring_unmap(ring);
+	close(ring->fd);
+	free(ring->slots);
+	free(ring->free_slots);
+	free(ring);
+	return NULL;
+}
+
+void libambxlight_uring_close(libambxlight_uring *ring) {
+	/* the kernel cancels what is still in flight when the fd goes */
+	uring_unmap(ring);
+	close(ring->fd);
+	free(ring->slots);
+	free(ring->free_slots);
+	free(ring);
+}
+
+int libambxlight_uring_fd(libambxlight_uring *ring) {
+	return ring->fd;
+}
+
+/* put a slot's write on the submission ring */
+static void uring_push(libambxlight_uring *ring, unsigned int index) {
+	struct uring_slot *slot = &ring->slots[index];
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	/* a free slot means a free sqe, there are as many of both */
+	tail = *ring->sq_tail;
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = slot->device->fd;
+	sqe->addr = (unsigned long)slot->data;
+	sqe->len = slot->len;
+	sqe->off = 0; /* ignored, the nodes don't seek */
+	sqe->user_data = index;
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/* the last write queued for fd and not reaped yet, or URING_NONE */
+static unsigned int uring_last_write(libambxlight_uring *ring, int fd) {
+	unsigned int i;
+
+	for (i = 0; i < ring->entries; i++) {
+		if (ring->slots[i].device && ring->slots[i].device->fd == fd && ring->slots[i].next == URING_NONE) {
+			return i;
+		}
+	}
+	return URING_NONE;
+}
+
+/*
+ * queue a write of len bytes to device, as write() would do it. data is
+ * copied, so it may be reused right away. returns -1 with errno set to
+ * EBUSY once every entry is queued or in flight.
+ */
+int libambxlight_uring_queue_write(libambxlight_uring *ring, libambxlight_device *device, const unsigned char *data, size_t len) {
+	struct uring_slot *slot;
+	unsigned int index;
+	unsigned int last;
+
+	if (len > URING_MAX_WRITE || (device->transport && device->transport != &libambxlight_kernel_transport)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!ring->nfree) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	last = uring_last_write(ring, device->fd);
+	index = ring->free_slots[--ring->nfree];
+	slot = &ring->slots[index];
+	slot->device = device;
+	slot->next = URING_NONE;
+	slot->len = len;
+	memcpy(slot->data, data, len);
+
+	if (last != URING_NONE) {
+		/* goes out once the write before it has completed */
+		ring->slots[last].next = index;
+		ring->held++;
+		return 0;
+	}
+	uring_push(ring, index);
+
+	return 0;
+}
+
+int libambxlight_uring_queue_color(libambxlight_uring *ring, libambxlight_device *device, unsigned char r, unsigned char g, unsigned char b, unsigned int msec) {
+	unsigned char data[9] = {
+		0xa2,
+		0x00,
+		r,
+		g,
+		b,
+		msec & 0xff,
+		(msec >> 8) & 0xff,
+		0x00,
+		0x00
+	};
+
+	return libambxlight_uring_queue_write(ring, device, data, sizeof(data));
+}
+
+/* hand everything queued to the kernel, one syscall */
+int libambxlight_uring_submit(libambxlight_uring *ring) {
+	int retval;
+
+	if (!ring->queued) {
+		return 0;
+	}
+	do {
+		retval = uring_enter(ring->fd, ring->queued, 0, 0);
+	} while (retval < 0 && errno == EINTR);
+	if (retval < 0) {
+		return -1;
+	}
+	ring->queued -= retval;
+	return retval;
+}
+
+/*
+ * read up to max completions. with wait set, sleep until there is at
+ * least one if none is ready and submitted writes are still in flight.
+ * short writes and errors such as -EAGAIN show in each completion's
+ * result. writes held back behind a reaped one are submitted before
+ * returning, together with anything else queued.
+ */
+int libambxlight_uring_reap(libambxlight_uring *ring, libambxlight_uring_completion *completions, unsigned int max, int wait) {
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	unsigned int head;
+	unsigned int n = 0;
+	unsigned int released = 0;
+
+	head = *ring->cq_head;
+	while (n < max) {
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			/* writes queued but not submitted will never complete */
+			if (n || !wait || ring->entries - ring->nfree - ring->held <= ring->queued) {
+				break;
+			}
+			if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+				return -1;
+			}
+			continue;
+		}
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		slot = &ring->slots[cqe->user_data];
+		completions[n].device = slot->device;
+		completions[n].result = cqe->res;
+		completions[n].expected = slot->len;
+		n++;
+
+		/* the next write to the same fd may go now */
+		if (slot->next != URING_NONE) {
+			uring_push(ring, slot->next);
+			ring->held--;
+			released++;
+		}
+		slot->device = NULL;
+		ring->free_slots[ring->nfree++] = cqe->user_data;
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	/* a failure leaves them queued for the next libambxlight_uring_submit() */
+	if (released) {
+		libambxlight_uring_submit(ring);
+	}
+
+	return n;
+}
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#include <libambxlight/libambxlight.h>
+#include <libambxlight/raw.h>
+
+/*
+ * usbfs transport, talks to the pod through /dev/bus/usb without the
+ * ambxlight module. Reports go out as asynchronous SET_REPORT control
+ * transfers from a pool of transfers kept for the life of the device, the
+ * reports of one write are submitted back to back.
+ */
+
+#define USBFS_VENDOR_ID 0x06a3
+#define USBFS_PRODUCT_ID 0x0dc5
+#define USBFS_INTERFACE 3 /* the pod's, unless it describes no such interface */
+#define USBFS_TRANSFERS 8
+#define USBFS_MAX_REPORT 64
+#define USBFS_TIMEOUT 1000 /* msec */
+
+struct usbfs_transfer {
+	struct usbdevfs_urb urb;
+	unsigned char buffer[sizeof(struct usb_ctrlrequest) + USBFS_MAX_REPORT];
+	int busy; /* submitted and not reaped yet */
+};
+
+struct usbfs_data {
+	unsigned int interface; /* claimed, and the wIndex of every report */
+	struct usbfs_transfer transfers[USBFS_TRANSFERS];
+	unsigned int in_flight;
+	int error; /* status of the last failed transfer, reported once */
+};
+
+/* take back one completed transfer, waiting for it unless nonblock */
+static int usbfs_reap(libambxlight_device *device, int nonblock) {
+	struct usbfs_data *data = device->transport_data;
+	struct usbfs_transfer *transfer;
+	void *urb;
+
+	if (ioctl(device->fd, nonblock ? USBDEVFS_REAPURBNDELAY : USBDEVFS_REAPURB, &urb) < 0) {
+		return -1;
+	}
+
+	transfer = ((struct usbdevfs_urb *)urb)->usercontext;
+	if (transfer->urb.status) {
+		data->error = transfer->urb.status;
+	}
+	transfer->busy = 0;
+	data->in_flight--;
+	return 0;
+}
+
+static void usbfs_drain(libambxlight_device *device) {
+	struct usbfs_data *data = device->transport_data;
+
+	while (data->in_flight && usbfs_reap(device, 0) == 0) {
+	}
+}
+
+static struct usbfs_transfer *usbfs_get_transfer(libambxlight_device *device) {
+	struct usbfs_data *data = device->transport_data;
+	unsigned int i;
+
+	/* collect what has completed, wait only if the pool is used up */
+	while (usbfs_reap(device, 1) == 0) {
+	}
+	if (data->in_flight == USBFS_TRANSFERS && usbfs_reap(device, 0) < 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < USBFS_TRANSFERS; i++) {
+		if (!data->transfers[i].busy) {
+			return &data->transfers[i];
+		}
+	}
+	return NULL;
+}
+
+static int usbfs_submit(libambxlight_device *device, const unsigned char *report, size_t size) {
+	struct usbfs_data *data = device->transport_data;
+	struct usbfs_transfer *transfer;
+	struct usb_ctrlrequest *setup;
+
+	transfer = usbfs_get_transfer(device);
+	if (!transfer) {
+		return -1;
+	}
+
+	setup = (struct usb_ctrlrequest *)transfer->buffer;
+	setup->bRequestType = 0x21;
+	setup->bRequest = 0x09;
+	setup->wValue = __cpu_to_le16(report[0]);
+	setup->wIndex = __cpu_to_le16(data->interface);
+	setup->wLength = __cpu_to_le16(size);
+	memcpy(transfer->buffer + sizeof(*setup), report, size);
+
+	memset(&transfer->urb, 0, sizeof(transfer->urb));
+	transfer->urb.type = USBDEVFS_URB_TYPE_CONTROL;
+	transfer->urb.endpoint = 0;
+	transfer->urb.buffer = transfer->buffer;
+	transfer->urb.buffer_length = sizeof(*setup) + size;
+	transfer->urb.usercontext = transfer;
+
+	if (ioctl(device->fd, USBDEVFS_SUBMITURB, &transfer->urb) < 0) {
+		return -1;
+	}
+	transfer->busy = 1;
+	data->in_flight++;
+	return 0;
+}
+
+/*
+ * the interface to claim, from the first configuration following the
+ * device descriptor on fd. emulated pods may describe a single one.
+ */
+static int usbfs_interface(int fd) {
+	struct usb_config_descriptor config;
+	unsigned char *descriptors;
+	struct usb_interface_descriptor *interface;
+	size_t len, offset;
+	int found = -1;
+
+	if (read(fd, &config, USB_DT_CONFIG_SIZE) != USB_DT_CONFIG_SIZE ||
+			__le16_to_cpu(config.wTotalLength) < USB_DT_CONFIG_SIZE) {
+		return -1;
+	}
+	len = __le16_to_cpu(config.wTotalLength) - USB_DT_CONFIG_SIZE;
+	descriptors = malloc(len);
+	if (!descriptors) {
+		return -1;
+	}
+	if (read(fd, descriptors, len) != (ssize_t)len) {
+		free(descriptors);
+		return -1;
+	}
+
+	for (offset = 0; offset + 2 <= len && descriptors[offset] >= 2; offset += descriptors[offset]) {
+		interface = (struct usb_interface_descriptor *)(descriptors + offset);
+		if (interface->bDescriptorType != USB_DT_INTERFACE || interface->bLength < USB_DT_INTERFACE_SIZE ||
+				offset + USB_DT_INTERFACE_SIZE > len || interface->bAlternateSetting != 0) {
+			continue;
+		}
+		if (interface->bInterfaceNumber == USBFS_INTERFACE || found < 0) {
+			found = interface->bInterfaceNumber;
+		}
+	}
+
+	free(descriptors);
+	return found;
+}
+
+/* open the minor-th pod found on the buses */
+static int usbfs_find(int minor) {
+	struct dirent **buses;
+	struct dirent **devices;
+	struct usb_device_descriptor descriptor;
+	char name[PATH_MAX];
+	int nbuses, ndevices;
+	int found = -1;
+	int i, j;
+	int fd;
+
+	nbuses = scandir("/dev/bus/usb", &buses, NULL, alphasort);
+	if (nbuses < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < nbuses; i++) {
+		if (found < 0 && buses[i]->d_name[0] != '.') {
+			snprintf(name, sizeof(name), "/dev/bus/usb/%s", buses[i]->d_name);
+			ndevices = scandir(name, &devices, NULL, alphasort);
+			for (j = 0; j < ndevices; j++) {
+				if (found < 0 && devices[j]->d_name[0] != '.') {
+					snprintf(name, sizeof(name), "/dev/bus/usb/%s/%s",
+							buses[i]->d_name, devices[j]->d_name);
+					fd = open(name, O_RDWR);
+					if (fd >= 0) {
+						/* usbfs nodes read back the descriptors */
+						if (read(fd, &descriptor, sizeof(descriptor)) == sizeof(descriptor) &&
+								__le16_to_cpu(descriptor.idVendor) == USBFS_VENDOR_ID &&
+								__le16_to_cpu(descriptor.idProduct) == USBFS_PRODUCT_ID &&
+								minor-- == 0) {
+							found = fd;
+						} else {
+							close(fd);
+						}
+					}
+				}
+				free(devices[j]);
+			}
+			if (ndevices >= 0) {
+				free(devices);
+			}
+		}
+		free(buses[i]);
+	}
+	free(buses);
+
+	return found;
+}
+
+static int usbfs_open(libambxlight_device *device) {
+	unsigned int interface;
+	struct usbfs_data *data;
+	int retval;
+
+	device->fd = usbfs_find(device->minor);
+	if (device->fd < 0) {
+		return -1;
+	}
+
+	/* the device descriptor has been read, the configuration follows */
+	retval = usbfs_interface(device->fd);
+	if (retval < 0) {
+		close(device->fd);
+		device->fd = -1;
+		return -1;
+	}
+	interface = retval;
+
+	/* fails with EBUSY while the module is bound to the pod */
+	if (ioctl(device->fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) {
+		close(device->fd);
+		device->fd = -1;
+		return -2;
+	}
+
+	data = calloc(1, sizeof(*data));
+	if (!data) {
+		ioctl(device->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+		close(device->fd);
+		device->fd = -1;
+		return -8;
+	}
+	data->interface = interface;
+	device->transport_data = data;
+	device->mode = (enum libambxlight_device_write_mode)RAW & 0xf;
+
+	libambxlight_get_params(device);
+	return 0;
+}
+
+static void usbfs_close(libambxlight_device *device) {
+	struct usbfs_data *data = device->transport_data;
+	unsigned int interface = data->interface;
+
+	usbfs_drain(device);
+	ioctl(device->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	close(device->fd);
+	device->fd = -1;
+	free(device->transport_data);
+	device->transport_data = NULL;
+}
+
+static ssize_t usbfs_write(libambxlight_device *device, const unsigned char *data, size_t len) {
+	struct usbfs_data *usbfs = device->transport_data;
+	size_t offset = 0;
+	ssize_t size;
+
+	if (usbfs->error) {
+		/* any error is reported once */
+		errno = -usbfs->error;
+		usbfs->error = 0;
+		return -1;
+	}
+
+	while (offset < len) {
+		size = ambxlight_raw_packet_size(data + offset, len - offset, USBFS_MAX_REPORT);
+		if (size < 0) {
+			errno = -size;
+			break;
+		}
+		if (usbfs_submit(device, data + offset, size) < 0) {
+			break;
+		}
+		offset += size;
+	}
+
+	return offset ? (ssize_t)offset : -1;
+}
+
+static int usbfs_read_params(libambxlight_device *device) {
+	struct usbfs_data *data = device->transport_data;
+	unsigned char prepare[2] = { 0xa7, 0x00 };
+	unsigned char buffer[11];
+	struct usbdevfs_ctrltransfer transfer = {
+		.bRequestType = 0x21,
+		.bRequest = 0x09,
+		.wValue = 0xa7,
+		.wIndex = data->interface,
+		.wLength = sizeof(prepare),
+		.timeout = USBFS_TIMEOUT,
+		.data = prepare,
+	};
+	int retval;
+
+	/* the read must see every report sent before it */
+	usbfs_drain(device);
+
+	if (ioctl(device->fd, USBDEVFS_CONTROL, &transfer) < 0) {
+		return -1;
+	}
+
+	transfer.bRequestType = 0xa1;
+	transfer.bRequest = 0x01;
+	transfer.wValue = 0x0b;
+	transfer.wLength = sizeof(buffer);
+	transfer.data = buffer;
+	retval = ioctl(device->fd, USBDEVFS_CONTROL, &transfer);
+	if (retval < 0) {
+		return -1;
+	}
+
+	if (retval > (int)sizeof(device->params)) {
+		retval = sizeof(device->params);
+	}
+	memcpy(&device->params, buffer, retval);
+	return retval;
+}
+
+const struct libambxlight_transport libambxlight_usbfs_transport = {
+	.name = "usbfs",
+	.open = usbfs_open,
+	.close = usbfs_close,
+	.write = usbfs_write,
+	.read_params = usbfs_read_params,
+};